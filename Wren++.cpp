@@ -1,41 +1,682 @@
 #include "Wren++.h"
 
 #include <cassert>
+#include <cctype>  // for isdigit
+#include <cmath>
+#include <cstdio>  // for snprintf
 #include <cstdlib>  // for malloc
 #include <cstring>  // for strcmp, memcpy
+#include <deque>
+#include <iomanip>
 #include <iostream>
+#include <locale>
+#include <unordered_set>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX__)
+#define WRENPP_AVX
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WRENPP_SSE
+#include <emmintrin.h>
+#endif
+
+#ifndef WRENPP_MAX_FUNCTORS
+#define WRENPP_MAX_FUNCTORS 256
+#endif
+
+namespace wrenpp
+{
+namespace detail
+{
+    // What was bound to a class, in the order it was bound
+    struct ClassDeclaration
+    {
+        std::string                               name;
+        bool                                      isForeign;
+        std::string                               constructor;
+        std::vector<std::pair<bool, std::string>> methods;
+    };
+
+    struct ModuleDeclaration
+    {
+        bool                          generated {false};
+        std::vector<ClassDeclaration> classes {};
+    };
+
+    // A functor bound with bindFunctor, owned by the table it was bound into
+    struct FunctorBinding
+    {
+        std::shared_ptr<void> functor;
+        FunctorInvoker        invoke;
+    };
+
+    // What a signature is bound to: a function, or a functor, which is given a thunk of its own
+    // in each VM which binds it
+    struct MethodBinding
+    {
+        WrenForeignMethodFn   function;
+        const FunctorBinding* functor;
+        bool                  inherited;  // copied from a base class by inheritMethods
+    };
+
+    // the functor which the VM gave the index-th thunk to
+    const FunctorBinding& vmFunctor(WrenVM* vm, std::size_t index);
+
+    template <std::size_t index>
+    void functorThunk(WrenVM* vm)
+    {
+        ProfileScope          profile(vm, &functorThunk<index>);
+        TraceScope            trace(vm, &functorThunk<index>);
+        const FunctorBinding& binding = vmFunctor(vm, index);
+        binding.invoke(binding.functor.get(), vm);
+    }
+
+    template <std::size_t... index>
+    constexpr std::array<WrenForeignMethodFn, sizeof...(index)> makeFunctorThunks(std::index_sequence<index...>)
+    {
+        return {{&functorThunk<index>...}};
+    }
+
+    constexpr std::array<WrenForeignMethodFn, WRENPP_MAX_FUNCTORS> functorThunks =
+        makeFunctorThunks(std::make_index_sequence<WRENPP_MAX_FUNCTORS>{});
+
+    class BindingTable
+    {
+    public:
+        BindingTable()                    = default;
+        BindingTable(const BindingTable&) = delete;
+        BindingTable& operator=(const BindingTable&) = delete;
+
+        ClassDeclaration& declaration(const std::string& mod, const std::string& className)
+        {
+            std::vector<ClassDeclaration>& classes = modules[mod].classes;
+            for (ClassDeclaration& c : classes)
+            {
+                if (c.name == className)
+                {
+                    return c;
+                }
+            }
+            classes.push_back(ClassDeclaration {className, false, std::string(), {}});
+            return classes.back();
+        }
+
+        SignatureMap<MethodBinding>                        methods {};
+        SignatureMap<WrenForeignClassMethods>              classes {};
+        std::unordered_map<std::string, ModuleDeclaration> modules {};
+        // a deque, so that the bindings don't move
+        std::deque<FunctorBinding>                         functors {};
+    };
+
+#if defined(WRENPP_PROFILE)
+    struct CallProfile
+    {
+        struct Stats
+        {
+            std::uint64_t                 calls {0u};
+            std::uint64_t                 totalNanoseconds {0u};
+            std::array<std::uint64_t, 32> histogram {};
+        };
+
+        std::unordered_map<WrenForeignMethodFn, Stats> stats {};
+    };
+#endif
+}
+}
 
 namespace
 {
+// A multi-producer single-consumer queue of tasks, after Dmitry Vyukov's intrusive MPSC node
+// queue. Producers never wait on each other or on the consumer.
+class Inbox
+{
+public:
+    struct Node
+    {
+        std::atomic<Node*>               next {nullptr};
+        std::function<void(wrenpp::VM&)> task {};
+    };
+
+    Inbox()
+        : _head {&_stub}
+        , _tail {&_stub}
+    {
+    }
+
+    Inbox(const Inbox&) = delete;
+    Inbox& operator=(const Inbox&) = delete;
+
+    ~Inbox()
+    {
+        while (Node* node = pop())
+        {
+            delete node;
+        }
+    }
+
+    void push(Node* node)
+    {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node* previous = _head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // Returns nullptr when empty, or when a producer is midway through a push. Only the
+    // consumer may call this.
+    Node* pop()
+    {
+        Node* tail = _tail;
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (tail == &_stub)
+        {
+            if (next == nullptr)
+            {
+                return nullptr;
+            }
+            _tail = next;
+            tail  = next;
+            next  = next->next.load(std::memory_order_acquire);
+        }
+        if (next)
+        {
+            _tail = next;
+            return tail;
+        }
+        if (tail != _head.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+        push(&_stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next)
+        {
+            _tail = next;
+            return tail;
+        }
+        return nullptr;
+    }
+
+private:
+    std::atomic<Node*> _head;
+    Node*              _tail;
+    Node               _stub {};
+};
+
+// Recordings start with this, followed by records which each start with a tag byte. Numbers
+// are written in the host's byte order.
+const char recordingMagic[8] = {'W', 'R', 'E', 'N', 'R', 'E', 'C', '1'};
+
+struct RecordableType
+{
+    std::size_t size;
+    void (*restore)(WrenVM*, int, const void*);
+};
+
+struct RecordableTypes
+{
+    std::mutex                  mutex {};
+    std::vector<RecordableType> types {};  // indexed by type id
+};
+
+RecordableTypes& recordableTypes()
+{
+    static RecordableTypes types {};
+    return types;
+}
+
+RecordableType recordableType(std::uint32_t typeId)
+{
+    RecordableTypes&            recordable = recordableTypes();
+    std::lock_guard<std::mutex> lock(recordable.mutex);
+    return typeId < recordable.types.size() ? recordable.types[typeId] : RecordableType {0u, nullptr};
+}
+
+class Recorder
+{
+public:
+    explicit Recorder(std::ostream& out)
+        : _out(out)
+    {
+        _out.write(recordingMagic, sizeof(recordingMagic));
+    }
+
+    void executed(char tag, const std::string& module, const std::string* source)
+    {
+        put(tag);
+        putString(module);
+        if (source)
+        {
+            putString(*source);
+        }
+    }
+
+    void called(WrenVM* vm, const wrenpp::detail::CallSite* site, int arity)
+    {
+        auto it = _sites.find(site);
+        if (it == _sites.end())
+        {
+            it = _sites.emplace(site, static_cast<std::uint32_t>(_sites.size())).first;
+            put('D');
+            put(it->second);
+            putString(site->module);
+            putString(site->variable);
+            putString(site->signature);
+        }
+
+        // Methods made from a handle and CallSignatures have no variable to look up when
+        // replaying, so their receiver is recorded along with the arguments
+        const int first = site->module.empty() ? 0 : 1;
+
+        // classes are defined before the call which first passes them
+        for (int slot = first; slot <= arity; ++slot)
+        {
+            if (wrenGetSlotType(vm, slot) == WREN_TYPE_FOREIGN)
+            {
+                defineClass(static_cast<wrenpp::detail::ForeignObject*>(wrenGetSlotForeign(vm, slot))->typeId());
+            }
+        }
+
+        put('C');
+        put(it->second);
+        put(static_cast<std::uint8_t>(arity));
+        for (int slot = first; slot <= arity; ++slot)
+        {
+            putArgument(vm, slot);
+        }
+    }
+
+private:
+    template <typename T>
+    void put(T value)
+    {
+        _out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void putString(const char* str, std::size_t length)
+    {
+        put(static_cast<std::uint32_t>(length));
+        _out.write(str, static_cast<std::streamsize>(length));
+    }
+
+    void putString(const std::string& str)
+    {
+        putString(str.data(), str.size());
+    }
+
+    void putArgument(WrenVM* vm, int slot)
+    {
+        switch (wrenGetSlotType(vm, slot))
+        {
+            case WREN_TYPE_NULL:
+                put('n');
+                break;
+            case WREN_TYPE_BOOL:
+                put('b');
+                put(static_cast<std::uint8_t>(wrenGetSlotBool(vm, slot)));
+                break;
+            case WREN_TYPE_NUM:
+                put('d');
+                put(wrenGetSlotDouble(vm, slot));
+                break;
+            case WREN_TYPE_STRING:
+            {
+                int         length = 0;
+                const char* str    = wrenGetSlotBytes(vm, slot, &length);
+                put('s');
+                putString(str, static_cast<std::size_t>(length));
+                break;
+            }
+            case WREN_TYPE_FOREIGN:
+                putForeign(static_cast<wrenpp::detail::ForeignObject*>(wrenGetSlotForeign(vm, slot)));
+                break;
+            default:
+                put('u');
+                break;
+        }
+    }
+
+    void putForeign(wrenpp::detail::ForeignObject* object)
+    {
+        const std::uint32_t  typeId = object->typeId();
+        const RecordableType type   = recordableType(typeId);
+        if (type.restore == nullptr || object->expired() || object->objectPtr() == nullptr)
+        {
+            put('u');
+            return;
+        }
+
+        put('f');
+        put(_classes.at(typeId));
+        _out.write(static_cast<const char*>(object->objectPtr()), static_cast<std::streamsize>(type.size));
+    }
+
+    void defineClass(std::uint32_t typeId)
+    {
+        if (recordableType(typeId).restore == nullptr || _classes.count(typeId) != 0u)
+        {
+            return;
+        }
+        const std::uint32_t id = static_cast<std::uint32_t>(_classes.size());
+        _classes.emplace(typeId, id);
+        put('K');
+        put(id);
+        putString(wrenpp::detail::moduleNameStorage()[typeId]);
+        putString(wrenpp::detail::classNameStorage()[typeId]);
+    }
+
+    std::ostream&                                                       _out;
+    std::unordered_map<const wrenpp::detail::CallSite*, std::uint32_t> _sites {};
+    std::unordered_map<std::uint32_t, std::uint32_t>                    _classes {};
+};
+
+// Call handles keyed by signature, shared by the Methods which use them. Handles stay cached
+// after their last Method goes away, until the cache is trimmed, so that looking the same method
+// up again doesn't make new handles. The cache also holds the call sites of the Methods, counted
+// like the handles. A recording refers to call sites by address, so they are only dropped while
+// the VM isn't recording.
+class HandleCache
+{
+public:
+    const wrenpp::detail::CallSite* callSite(const std::string& module, const std::string& variable,
+                                             const std::string& signature)
+    {
+        SiteEntry& entry = _sites[signature][module][variable];
+        if (!entry.site)
+        {
+            entry.site.reset(new wrenpp::detail::CallSite {
+                module, variable, signature, module.empty() ? signature : module + '.' + variable + '.' + signature});
+        }
+        ++entry.refs;
+        return entry.site.get();
+    }
+
+    void releaseSite(const wrenpp::detail::CallSite* site)
+    {
+        if (site == nullptr)
+        {
+            return;
+        }
+        SiteEntry& entry = _sites[site->signature][site->module][site->variable];
+        assert(entry.site.get() == site && entry.refs > 0u);
+        --entry.refs;
+    }
+
+    WrenHandle* callHandle(WrenVM* vm, const std::string& signature)
+    {
+        auto it = _calls.find(signature);
+        if (it == _calls.end())
+        {
+            it = _calls.emplace(signature, wrenMakeCallHandle(vm, signature.c_str())).first;
+            _refs.emplace(it->second, 0u);
+        }
+        acquire(it->second);
+        return it->second;
+    }
+
+    // Handles which didn't come from the cache belong to their one user, and are released
+    // right away.
+    void release(WrenVM* vm, WrenHandle* handle)
+    {
+        auto it = _refs.find(handle);
+        if (it == _refs.end())
+        {
+            wrenReleaseHandle(vm, handle);
+            return;
+        }
+        assert(it->second > 0u);
+        --it->second;
+    }
+
+    // Releases the cached handles which no Method uses any more, and drops the unused call sites
+    // if asked to. Returns how many handles were released.
+    std::size_t trim(WrenVM* vm, bool sites)
+    {
+        if (sites)
+        {
+            trimSites();
+        }
+
+        std::size_t released = 0u;
+        for (auto it = _calls.begin(); it != _calls.end();)
+        {
+            auto ref = _refs.find(it->second);
+            if (ref->second != 0u)
+            {
+                ++it;
+                continue;
+            }
+            wrenReleaseHandle(vm, it->second);
+            _refs.erase(ref);
+            it = _calls.erase(it);
+            ++released;
+        }
+        return released;
+    }
+
+    std::size_t size() const
+    {
+        return _refs.size();
+    }
+
+private:
+    struct SiteEntry
+    {
+        std::unique_ptr<wrenpp::detail::CallSite> site {};
+        std::size_t                               refs {0u};
+    };
+
+    void acquire(WrenHandle* handle)
+    {
+        ++_refs[handle];
+    }
+
+    void trimSites()
+    {
+        for (auto signature = _sites.begin(); signature != _sites.end();)
+        {
+            for (auto module = signature->second.begin(); module != signature->second.end();)
+            {
+                for (auto variable = module->second.begin(); variable != module->second.end();)
+                {
+                    variable = variable->second.refs == 0u ? module->second.erase(variable) : std::next(variable);
+                }
+                module = module->second.empty() ? signature->second.erase(module) : std::next(module);
+            }
+            signature = signature->second.empty() ? _sites.erase(signature) : std::next(signature);
+        }
+    }
+
+    std::unordered_map<std::string, WrenHandle*> _calls {};
+    std::unordered_map<WrenHandle*, std::size_t> _refs {};
+    // keyed by signature, module and variable
+    std::unordered_map<std::string, std::unordered_map<std::string, std::unordered_map<std::string, SiteEntry>>>
+        _sites {};
+};
+
 struct BoundState
 {
-    std::unordered_map<std::size_t, WrenForeignMethodFn>     methods {};
-    std::unordered_map<std::size_t, WrenForeignClassMethods> classes {};
+    wrenpp::detail::BindingTable                              own {};
+    // shared binding sets, searched after the VM's own bindings
+    std::vector<const wrenpp::detail::BindingTable*>          shared {};
+    // modules which haven't been bound yet, along with their binders
+    std::vector<std::pair<std::string, wrenpp::ModuleBinder>> deferred {};
+    Inbox                                                     inbox {};
+    // indexed by type id; a deque, so that growing it doesn't move the entries
+    std::deque<wrenpp::detail::TypeCensus>                    census {};
+    std::unique_ptr<Recorder>                                 recorder {};
+    HandleCache                                               handles {};
+    // the functors given thunks in this VM, indexed like the thunks
+    std::vector<const wrenpp::detail::FunctorBinding*>        functors {};
+    // the span names of the bound functions traced so far, interned
+    std::unordered_map<WrenForeignMethodFn, const char*>      traceNames {};
+#if defined(WRENPP_PROFILE)
+    bool                                                      profiling {false};
+    wrenpp::detail::CallProfile                               profile {};
+#endif
 };
 
+// Names a bound function after a signature it's bound to in the VM, searching the VM's own
+// bindings first. Names are only looked up for reports, so that binding builds no strings. A
+// function bound to several signatures is named after the class which declared it rather than
+// the classes inheriting it, and then after the first of the names, so that the name doesn't
+// depend on the order of binding.
+std::string functionName(const BoundState& boundState, WrenForeignMethodFn function)
+{
+    // functor thunks are named after the binding of the functor the VM gave them to
+    const wrenpp::detail::FunctorBinding* functor = nullptr;
+    for (std::size_t i = 0u; i < boundState.functors.size(); ++i)
+    {
+        if (wrenpp::detail::functorThunks[i] == function)
+        {
+            functor = boundState.functors[i];
+        }
+    }
+
+    std::string name;
+    bool        inherited = false;
+    auto        search    = [&name, &inherited, function, functor](const wrenpp::detail::BindingTable& table) {
+        table.methods.forEach([&name, &inherited, function, functor](
+                                  const std::string& module, const std::string& className, bool isStatic,
+                                  const std::string& signature, const wrenpp::detail::MethodBinding& bound) {
+            const bool matches = functor ? bound.functor == functor : bound.function == function;
+            if (!matches || (!name.empty() && bound.inherited && !inherited))
+            {
+                return;
+            }
+            std::string candidate = module + '.' + className + (isStatic ? ".static " : ".") + signature;
+            if (name.empty() || (inherited && !bound.inherited) || candidate < name)
+            {
+                name      = std::move(candidate);
+                inherited = bound.inherited;
+            }
+        });
+        table.classes.forEach([&name, function](const std::string& module, const std::string& className, bool,
+                                                const std::string&, const WrenForeignClassMethods& bound) {
+            if (bound.allocate == function && name.empty())
+            {
+                name = module + '.' + className + ".<allocate>";
+            }
+        });
+        return !name.empty();
+    };
+
+    if (search(boundState.own))
+    {
+        return name;
+    }
+    for (const wrenpp::detail::BindingTable* table : boundState.shared)
+    {
+        if (search(*table))
+        {
+            return name;
+        }
+    }
+    return "<unknown>";
+}
+
+// Runs the binder of a deferred module, if the module has one. Compares the names in place,
+// so that the lookup allocates nothing when no module is deferred.
+void bindDeferred(WrenVM* vm, BoundState& boundState, const char* module)
+{
+    for (auto it = boundState.deferred.begin(); it != boundState.deferred.end(); ++it)
+    {
+        if (it->first == module)
+        {
+            wrenpp::ModuleBinder binder = std::move(it->second);
+            boundState.deferred.erase(it);
+            wrenpp::ModuleContext context(vm, module);
+            // binders run within Wren's callbacks, which exceptions must not unwind through
+            try
+            {
+                binder(context);
+            }
+            catch (const std::exception& e)
+            {
+                wrenpp::VM::errorFn(WREN_ERROR_COMPILE, module, 0, e.what());
+            }
+            return;
+        }
+    }
+}
+
+void functorLimitReached(WrenVM* vm)
+{
+    wrenpp::detail::abortFiber(vm, "wrenpp: more than WRENPP_MAX_FUNCTORS functors bound in this VM");
+}
+
+// Returns the function which a binding calls in the VM. A functor is given the next free
+// thunk the first time the VM binds it.
+WrenForeignMethodFn boundFunction(BoundState& boundState, const wrenpp::detail::MethodBinding& binding)
+{
+    if (binding.function)
+    {
+        return binding.function;
+    }
+
+    auto& functors = boundState.functors;
+    auto  it       = std::find(functors.begin(), functors.end(), binding.functor);
+    if (it == functors.end())
+    {
+        if (functors.size() == WRENPP_MAX_FUNCTORS)
+        {
+            return functorLimitReached;
+        }
+        it = functors.insert(functors.end(), binding.functor);
+    }
+    return wrenpp::detail::functorThunks[static_cast<std::size_t>(it - functors.begin())];
+}
+
 WrenForeignMethodFn foreignMethodProvider(
     WrenVM* vm, const char* module, const char* className, bool isStatic, const char* signature)
 {
-    auto* boundState = static_cast<BoundState*>(wrenGetUserData(vm));
-    auto  it = boundState->methods.find(wrenpp::detail::hashMethodSignature(module, className, isStatic, signature));
-    if (it == boundState->methods.end())
+    auto*         boundState = static_cast<BoundState*>(wrenGetUserData(vm));
+    std::uint64_t hash       = wrenpp::detail::hashMethodSignature(module, className, isStatic, signature);
+    bindDeferred(vm, *boundState, module);
+    if (const auto* binding = boundState->own.methods.find(hash, module, className, isStatic, signature))
     {
-        return nullptr;
+        return boundFunction(*boundState, *binding);
+    }
+
+    for (const wrenpp::detail::BindingTable* table : boundState->shared)
+    {
+        if (const auto* binding = table->methods.find(hash, module, className, isStatic, signature))
+        {
+            return boundFunction(*boundState, *binding);
+        }
     }
 
-    return it->second;
+    return nullptr;
 }
 
 WrenForeignClassMethods foreignClassProvider(WrenVM* vm, const char* m, const char* c)
 {
-    auto* boundState = static_cast<BoundState*>(wrenGetUserData(vm));
-    auto  it         = boundState->classes.find(wrenpp::detail::hashClassSignature(m, c));
-    if (it == boundState->classes.end())
+    auto*         boundState = static_cast<BoundState*>(wrenGetUserData(vm));
+    std::uint64_t hash       = wrenpp::detail::hashClassSignature(m, c);
+    bindDeferred(vm, *boundState, m);
+    if (const WrenForeignClassMethods* methods = boundState->own.classes.find(hash, m, c, false, ""))
+    {
+        return *methods;
+    }
+
+    for (const wrenpp::detail::BindingTable* table : boundState->shared)
     {
-        return WrenForeignClassMethods {nullptr, nullptr};
+        if (const WrenForeignClassMethods* methods = table->classes.find(hash, m, c, false, ""))
+        {
+            return *methods;
+        }
     }
 
-    return it->second;
+    return WrenForeignClassMethods {nullptr, nullptr};
 }
 
 inline const char* errorTypeToString(WrenErrorType type)
@@ -54,173 +695,3008 @@ inline const char* errorTypeToString(WrenErrorType type)
     }
 }
 
-char* loadModuleFnWrapper(WrenVM* /*vm*/, const char* mod)
+#ifndef WRENPP_TRACE_EVENTS
+#define WRENPP_TRACE_EVENTS 65536
+#endif
+
+struct TraceEvent
 {
-    return wrenpp::VM::loadModuleFn(mod);
-}
+    const char*   name;
+    std::uint64_t nanoseconds;
+    char          phase;
+};
 
-void writeFnWrapper(WrenVM* /*vm*/, const char* text)
+// Written only by its own thread. The size is published with release semantics, so that the
+// events below it can be read from other threads at any time.
+struct TraceBuffer
 {
-    wrenpp::VM::writeFn(text);
+    TraceBuffer()
+        : events {new TraceEvent[WRENPP_TRACE_EVENTS]}
+    {
+    }
+
+    std::unique_ptr<TraceEvent[]> events;
+    std::atomic<std::size_t>      size {0u};
+    std::uint32_t                 thread {0u};
+    bool                          retired {false};  // its thread has exited; guarded by the registry
+};
+
+struct TraceRegistry
+{
+    std::mutex                                mutex {};
+    std::vector<std::shared_ptr<TraceBuffer>> buffers {};
+    // buffers of exited threads, emptied, for the next threads to use
+    std::vector<std::shared_ptr<TraceBuffer>> spare {};
+    std::uint32_t                             threads {0u};
+};
+
+TraceRegistry& traceRegistry()
+{
+    static TraceRegistry registry {};
+    return registry;
 }
 
-void errorFnWrapper(WrenVM*, WrenErrorType type, const char* module, int line, const char* message)
+// Moves the retired buffers, whose events are no longer needed, to the spare ones. The registry
+// must be locked.
+void recycleTraceBuffers(TraceRegistry& registry)
 {
-    wrenpp::VM::errorFn(type, module, line, message);
+    for (auto it = registry.buffers.begin(); it != registry.buffers.end();)
+    {
+        if ((*it)->retired)
+        {
+            (*it)->size.store(0u, std::memory_order_relaxed);
+            registry.spare.push_back(std::move(*it));
+            it = registry.buffers.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
 }
 
-void* reallocateFnWrapper(void* memory, std::size_t newSize)
+// A thread's buffer is registered on its first event. When the thread exits, the buffer is
+// retired, and kept until its events have been written out or cleared; then it is reused by
+// another thread, so that threads which come and go don't each leave a buffer behind.
+class ThreadTraceBuffer
 {
-    return wrenpp::VM::reallocateFn(memory, newSize);
+public:
+    ThreadTraceBuffer()
+    {
+        TraceRegistry&              registry = traceRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        if (registry.spare.empty())
+        {
+            _buffer = std::make_shared<TraceBuffer>();
+        }
+        else
+        {
+            _buffer = std::move(registry.spare.back());
+            registry.spare.pop_back();
+        }
+        _buffer->thread  = ++registry.threads;
+        _buffer->retired = false;
+        registry.buffers.push_back(_buffer);
+    }
+
+    ThreadTraceBuffer(const ThreadTraceBuffer&) = delete;
+    ThreadTraceBuffer& operator=(const ThreadTraceBuffer&) = delete;
+
+    ~ThreadTraceBuffer()
+    {
+        TraceRegistry&              registry = traceRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        _buffer->retired = true;
+        if (_buffer->size.load(std::memory_order_relaxed) == 0u)
+        {
+            recycleTraceBuffers(registry);
+        }
+    }
+
+    TraceBuffer& buffer()
+    {
+        return *_buffer;
+    }
+
+private:
+    std::shared_ptr<TraceBuffer> _buffer;
+};
+
+TraceBuffer& threadTraceBuffer()
+{
+    thread_local ThreadTraceBuffer buffer;
+    return buffer.buffer();
 }
+
+// Interns "prefix what" when tracing, so that the span can name what it ran.
+const char* tracedName(const char* prefix, const std::string& what)
+{
+    if (!wrenpp::detail::tracing.load(std::memory_order_relaxed))
+    {
+        return prefix;
+    }
+    return wrenpp::detail::internName(prefix + what);
 }
 
-namespace wrenpp
+void writeJsonString(std::ostream& out, const std::string& str)
 {
-namespace detail
+    out << '"';
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out << '\\' << c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20u)
+        {
+            out << ' ';
+        }
+        else
+        {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+// Turns a signature into a declaration by naming its parameters: "[_]=(_)" becomes
+// "[a0]=(a1)". Underscores in the method name are left alone.
+std::string declareSignature(const std::string& signature)
 {
-    void registerFunction(WrenVM*             vm,
-                          const std::string&  mod,
-                          const std::string&  cName,
-                          bool                isStatic,
-                          std::string         sig,
-                          WrenForeignMethodFn function)
+    std::string declaration;
+    int         depth      = 0;
+    int         parameters = 0;
+    for (char c : signature)
     {
-        BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(vm));
-        std::size_t hash       = detail::hashMethodSignature(mod.c_str(), cName.c_str(), isStatic, sig.c_str());
-        boundState->methods.insert(std::make_pair(hash, function));
+        if (c == '(' || c == '[')
+        {
+            ++depth;
+        }
+        else if (c == ')' || c == ']')
+        {
+            --depth;
+        }
+
+        if (c == '_' && depth > 0)
+        {
+            declaration += 'a';
+            declaration += std::to_string(parameters++);
+        }
+        else if (c == ',' && depth > 0)
+        {
+            declaration += ", ";
+        }
+        else
+        {
+            declaration += c;
+        }
     }
+    return declaration;
+}
 
-    void registerClass(WrenVM* vm, const std::string& mod, std::string cName, WrenForeignClassMethods methods)
+std::string generateSource(const wrenpp::detail::ModuleDeclaration& module)
+{
+    std::string source;
+    for (const wrenpp::detail::ClassDeclaration& c : module.classes)
     {
-        BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(vm));
-        std::size_t hash       = detail::hashClassSignature(mod.c_str(), cName.c_str());
-        boundState->classes.insert(std::make_pair(hash, methods));
+        source += c.isForeign ? "foreign class " : "class ";
+        source += c.name;
+        source += " {\n";
+        if (!c.constructor.empty())
+        {
+            source += "    construct ";
+            source += declareSignature(c.constructor);
+            source += " {}\n\n";
+        }
+        for (const auto& method : c.methods)
+        {
+            source += method.first ? "    foreign static " : "    foreign ";
+            source += declareSignature(method.second);
+            source += '\n';
+        }
+        source += "}\n\n";
     }
+    return source;
 }
 
-Value null = Value();
+const wrenpp::detail::ModuleDeclaration* findModule(const wrenpp::detail::BindingTable& table, const char* mod)
+{
+    auto it = table.modules.find(mod);
+    return it != table.modules.end() ? &it->second : nullptr;
+}
 
-Value::Value(bool val)
-    : _type {WREN_TYPE_BOOL}
-    , _string {nullptr}
+// Returns the module's generated declarations if it opted into them, or else the source from
+// loadModuleFn. Deferred modules are bound first, so that their declarations exist.
+char* loadModuleSource(WrenVM* vm, const char* mod)
 {
-    set(val);
+    auto* boundState = static_cast<BoundState*>(wrenGetUserData(vm));
+    bindDeferred(vm, *boundState, mod);
+
+    const wrenpp::detail::ModuleDeclaration* module = findModule(boundState->own, mod);
+    for (const wrenpp::detail::BindingTable* table : boundState->shared)
+    {
+        if (module == nullptr)
+        {
+            module = findModule(*table, mod);
+        }
+    }
+
+    if (module == nullptr || !module->generated)
+    {
+        return wrenpp::VM::loadModuleFn(mod);
+    }
+
+    const std::string source = generateSource(*module);
+    char*             buffer = static_cast<char*>(malloc(source.size() + 1u));
+    assert(buffer != nullptr);
+    memcpy(buffer, source.c_str(), source.size() + 1u);
+    return buffer;
 }
 
-Value::Value(float val)
-    : _type {WREN_TYPE_NUM}
-    , _string {nullptr}
+char* loadModuleFnWrapper(WrenVM* vm, const char* mod)
 {
-    set(val);
+    return loadModuleSource(vm, mod);
 }
 
-Value::Value(double val)
-    : _type {WREN_TYPE_NUM}
-    , _string {nullptr}
+void writeFnWrapper(WrenVM* /*vm*/, const char* text)
 {
-    set(val);
+    wrenpp::VM::writeFn(text);
 }
 
-Value::Value(int val)
-    : _type {WREN_TYPE_NUM}
-    , _string {nullptr}
+void errorFnWrapper(WrenVM*, WrenErrorType type, const char* module, int line, const char* message)
 {
-    set(val);
+    wrenpp::VM::errorFn(type, module, line, message);
 }
 
-Value::Value(unsigned int val)
-    : _type {WREN_TYPE_NUM}
-    , _string {nullptr}
+void* reallocateFnWrapper(void* memory, std::size_t newSize)
+{
+    return wrenpp::VM::reallocateFn(memory, newSize);
+}
+
+// Lane abstraction for the numeric kernels. The generic version is the scalar fallback, used
+// when the compiler targets neither AVX nor SSE2.
+template <typename T>
+struct Lanes
+{
+    using Vector = T;
+    static constexpr std::size_t width = 1u;
+
+    static Vector load(const T* p)
+    {
+        return *p;
+    }
+
+    static void store(T* p, Vector v)
+    {
+        *p = v;
+    }
+
+    static Vector splat(T x)
+    {
+        return x;
+    }
+
+    static Vector add(Vector a, Vector b)
+    {
+        return a + b;
+    }
+
+    static Vector mul(Vector a, Vector b)
+    {
+        return a * b;
+    }
+
+    static Vector min(Vector a, Vector b)
+    {
+        return b < a ? b : a;
+    }
+
+    static Vector max(Vector a, Vector b)
+    {
+        return a < b ? b : a;
+    }
+
+    static Vector fma(Vector a, Vector b, Vector c)
+    {
+        return a * b + c;
+    }
+};
+
+#if defined(WRENPP_AVX)
+struct FloatLanes
+{
+    using Vector = __m256;
+    static constexpr std::size_t width = 8u;
+
+    static Vector load(const float* p)
+    {
+        return _mm256_loadu_ps(p);
+    }
+
+    static void store(float* p, Vector v)
+    {
+        _mm256_storeu_ps(p, v);
+    }
+
+    static Vector splat(float x)
+    {
+        return _mm256_set1_ps(x);
+    }
+
+    static Vector add(Vector a, Vector b)
+    {
+        return _mm256_add_ps(a, b);
+    }
+
+    static Vector mul(Vector a, Vector b)
+    {
+        return _mm256_mul_ps(a, b);
+    }
+
+    static Vector min(Vector a, Vector b)
+    {
+        return _mm256_min_ps(a, b);
+    }
+
+    static Vector max(Vector a, Vector b)
+    {
+        return _mm256_max_ps(a, b);
+    }
+#if defined(__FMA__)
+    static Vector fma(Vector a, Vector b, Vector c)
+    {
+        return _mm256_fmadd_ps(a, b, c);
+    }
+#else
+    static Vector fma(Vector a, Vector b, Vector c)
+    {
+        return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+    }
+#endif
+};
+
+struct DoubleLanes
+{
+    using Vector = __m256d;
+    static constexpr std::size_t width = 4u;
+
+    static Vector load(const double* p)
+    {
+        return _mm256_loadu_pd(p);
+    }
+
+    static void store(double* p, Vector v)
+    {
+        _mm256_storeu_pd(p, v);
+    }
+
+    static Vector splat(double x)
+    {
+        return _mm256_set1_pd(x);
+    }
+
+    static Vector add(Vector a, Vector b)
+    {
+        return _mm256_add_pd(a, b);
+    }
+
+    static Vector mul(Vector a, Vector b)
+    {
+        return _mm256_mul_pd(a, b);
+    }
+
+    static Vector min(Vector a, Vector b)
+    {
+        return _mm256_min_pd(a, b);
+    }
+
+    static Vector max(Vector a, Vector b)
+    {
+        return _mm256_max_pd(a, b);
+    }
+#if defined(__FMA__)
+    static Vector fma(Vector a, Vector b, Vector c)
+    {
+        return _mm256_fmadd_pd(a, b, c);
+    }
+#else
+    static Vector fma(Vector a, Vector b, Vector c)
+    {
+        return _mm256_add_pd(_mm256_mul_pd(a, b), c);
+    }
+#endif
+};
+#elif defined(WRENPP_SSE)
+struct FloatLanes
+{
+    using Vector = __m128;
+    static constexpr std::size_t width = 4u;
+
+    static Vector load(const float* p)
+    {
+        return _mm_loadu_ps(p);
+    }
+
+    static void store(float* p, Vector v)
+    {
+        _mm_storeu_ps(p, v);
+    }
+
+    static Vector splat(float x)
+    {
+        return _mm_set1_ps(x);
+    }
+
+    static Vector add(Vector a, Vector b)
+    {
+        return _mm_add_ps(a, b);
+    }
+
+    static Vector mul(Vector a, Vector b)
+    {
+        return _mm_mul_ps(a, b);
+    }
+
+    static Vector min(Vector a, Vector b)
+    {
+        return _mm_min_ps(a, b);
+    }
+
+    static Vector max(Vector a, Vector b)
+    {
+        return _mm_max_ps(a, b);
+    }
+
+    static Vector fma(Vector a, Vector b, Vector c)
+    {
+        return _mm_add_ps(_mm_mul_ps(a, b), c);
+    }
+};
+
+struct DoubleLanes
+{
+    using Vector = __m128d;
+    static constexpr std::size_t width = 2u;
+
+    static Vector load(const double* p)
+    {
+        return _mm_loadu_pd(p);
+    }
+
+    static void store(double* p, Vector v)
+    {
+        _mm_storeu_pd(p, v);
+    }
+
+    static Vector splat(double x)
+    {
+        return _mm_set1_pd(x);
+    }
+
+    static Vector add(Vector a, Vector b)
+    {
+        return _mm_add_pd(a, b);
+    }
+
+    static Vector mul(Vector a, Vector b)
+    {
+        return _mm_mul_pd(a, b);
+    }
+
+    static Vector min(Vector a, Vector b)
+    {
+        return _mm_min_pd(a, b);
+    }
+
+    static Vector max(Vector a, Vector b)
+    {
+        return _mm_max_pd(a, b);
+    }
+
+    static Vector fma(Vector a, Vector b, Vector c)
+    {
+        return _mm_add_pd(_mm_mul_pd(a, b), c);
+    }
+};
+#else
+using FloatLanes  = Lanes<float>;
+using DoubleLanes = Lanes<double>;
+#endif
+
+template <typename T>
+struct LanesFor;
+
+template <>
+struct LanesFor<float>
+{
+    using Type = FloatLanes;
+};
+
+template <>
+struct LanesFor<double>
+{
+    using Type = DoubleLanes;
+};
+
+template <typename T>
+void addImpl(T* dst, const T* src, std::size_t count)
+{
+    using L       = typename LanesFor<T>::Type;
+    std::size_t i = 0u;
+    for (; i + L::width <= count; i += L::width)
+    {
+        L::store(dst + i, L::add(L::load(dst + i), L::load(src + i)));
+    }
+    for (; i < count; ++i)
+    {
+        dst[i] += src[i];
+    }
+}
+
+template <typename T>
+void mulImpl(T* dst, const T* src, std::size_t count)
+{
+    using L       = typename LanesFor<T>::Type;
+    std::size_t i = 0u;
+    for (; i + L::width <= count; i += L::width)
+    {
+        L::store(dst + i, L::mul(L::load(dst + i), L::load(src + i)));
+    }
+    for (; i < count; ++i)
+    {
+        dst[i] *= src[i];
+    }
+}
+
+template <typename T>
+void fmaImpl(T* dst, const T* a, const T* b, std::size_t count)
+{
+    using L       = typename LanesFor<T>::Type;
+    std::size_t i = 0u;
+    for (; i + L::width <= count; i += L::width)
+    {
+        L::store(dst + i, L::fma(L::load(a + i), L::load(b + i), L::load(dst + i)));
+    }
+    for (; i < count; ++i)
+    {
+        dst[i] += a[i] * b[i];
+    }
+}
+
+template <typename T>
+void scaleImpl(T* dst, T factor, std::size_t count)
+{
+    using L                    = typename LanesFor<T>::Type;
+    const typename L::Vector f = L::splat(factor);
+    std::size_t              i = 0u;
+    for (; i + L::width <= count; i += L::width)
+    {
+        L::store(dst + i, L::mul(L::load(dst + i), f));
+    }
+    for (; i < count; ++i)
+    {
+        dst[i] *= factor;
+    }
+}
+
+// Folds the lanes of an accumulator into a scalar with the given scalar operation.
+template <typename T, typename L, typename Op>
+T reduceLanes(typename L::Vector v, Op op)
+{
+    T lanes[L::width];
+    L::store(lanes, v);
+    T result = lanes[0];
+    for (std::size_t i = 1u; i < L::width; ++i)
+    {
+        result = op(result, lanes[i]);
+    }
+    return result;
+}
+
+template <typename T>
+T dotImpl(const T* a, const T* b, std::size_t count)
+{
+    using L                = typename LanesFor<T>::Type;
+    typename L::Vector acc = L::splat(T(0));
+    std::size_t        i   = 0u;
+    for (; i + L::width <= count; i += L::width)
+    {
+        acc = L::fma(L::load(a + i), L::load(b + i), acc);
+    }
+    T result = reduceLanes<T, L>(acc, [](T x, T y) { return x + y; });
+    for (; i < count; ++i)
+    {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+template <typename T>
+T sumImpl(const T* src, std::size_t count)
+{
+    using L                = typename LanesFor<T>::Type;
+    typename L::Vector acc = L::splat(T(0));
+    std::size_t        i   = 0u;
+    for (; i + L::width <= count; i += L::width)
+    {
+        acc = L::add(acc, L::load(src + i));
+    }
+    T result = reduceLanes<T, L>(acc, [](T x, T y) { return x + y; });
+    for (; i < count; ++i)
+    {
+        result += src[i];
+    }
+    return result;
+}
+
+// expects count > 0
+template <typename T>
+T minImpl(const T* src, std::size_t count)
+{
+    using L                = typename LanesFor<T>::Type;
+    typename L::Vector acc = L::splat(src[0]);
+    std::size_t        i   = 0u;
+    for (; i + L::width <= count; i += L::width)
+    {
+        acc = L::min(acc, L::load(src + i));
+    }
+    T result = reduceLanes<T, L>(acc, [](T x, T y) { return y < x ? y : x; });
+    for (; i < count; ++i)
+    {
+        result = src[i] < result ? src[i] : result;
+    }
+    return result;
+}
+
+// expects count > 0
+template <typename T>
+T maxImpl(const T* src, std::size_t count)
+{
+    using L                = typename LanesFor<T>::Type;
+    typename L::Vector acc = L::splat(src[0]);
+    std::size_t        i   = 0u;
+    for (; i + L::width <= count; i += L::width)
+    {
+        acc = L::max(acc, L::load(src + i));
+    }
+    T result = reduceLanes<T, L>(acc, [](T x, T y) { return x < y ? y : x; });
+    for (; i < count; ++i)
+    {
+        result = result < src[i] ? src[i] : result;
+    }
+    return result;
+}
+}
+
+namespace wrenpp
+{
+namespace detail
+{
+    void registerMethod(BindingTable&      table,
+                        const std::string& mod,
+                        const std::string& cName,
+                        bool               isStatic,
+                        Signature          sig,
+                        MethodBinding      binding)
+    {
+        const std::uint64_t hash =
+            hashMethodSignature(hashClassSignature(mod.c_str(), cName.c_str()), isStatic, sig.hash());
+        MethodBinding* bound = table.methods.find(hash, mod.c_str(), cName.c_str(), isStatic, sig.text());
+        if (bound == nullptr)
+        {
+            table.methods.insert(hash, mod, cName, isStatic, sig.text(), binding);
+        }
+        else if (bound->inherited && !binding.inherited)
+        {
+            // the derived class overrides the base, whichever was bound first
+            *bound = binding;
+        }
+
+        auto& declared = table.declaration(mod, cName).methods;
+        auto  method   = std::make_pair(isStatic, std::string(sig.text()));
+        if (std::find(declared.begin(), declared.end(), method) == declared.end())
+        {
+            declared.push_back(std::move(method));
+        }
+    }
+
+    void registerFunction(BindingTable&       table,
+                          const std::string&  mod,
+                          const std::string&  cName,
+                          bool                isStatic,
+                          Signature           sig,
+                          WrenForeignMethodFn function)
+    {
+        registerMethod(table, mod, cName, isStatic, sig, MethodBinding {function, nullptr, false});
+    }
+
+    void registerFunctor(BindingTable&         table,
+                         const std::string&    mod,
+                         const std::string&    cName,
+                         bool                  isStatic,
+                         Signature             sig,
+                         std::shared_ptr<void> functor,
+                         FunctorInvoker        invoke)
+    {
+        table.functors.push_back(FunctorBinding {std::move(functor), invoke});
+        registerMethod(table, mod, cName, isStatic, sig, MethodBinding {nullptr, &table.functors.back(), false});
+    }
+
+    void registerClass(BindingTable&           table,
+                       const std::string&      mod,
+                       std::string             cName,
+                       std::string             constructor,
+                       WrenForeignClassMethods methods)
+    {
+        std::uint64_t hash = detail::hashClassSignature(mod.c_str(), cName.c_str());
+        table.classes.insert(hash, mod, cName, false, std::string(), methods);
+
+        ClassDeclaration& declaration = table.declaration(mod, cName);
+        declaration.isForeign         = true;
+        declaration.constructor       = std::move(constructor);
+    }
+
+    bool hasClass(const BindingTable& table, const std::string& mod, const std::string& cName)
+    {
+        std::uint64_t hash = detail::hashClassSignature(mod.c_str(), cName.c_str());
+        return table.classes.find(hash, mod.c_str(), cName.c_str(), false, "") != nullptr;
+    }
+
+    void generateDeclarations(BindingTable& table, const std::string& mod)
+    {
+        table.modules[mod].generated = true;
+    }
+
+    void inheritMethods(WrenVM*            vm,
+                        BindingTable&      table,
+                        const std::string& baseModule,
+                        const std::string& baseClass,
+                        const std::string& mod,
+                        const std::string& clss)
+    {
+        const BindingTable* source = hasClass(table, baseModule, baseClass) ? &table : nullptr;
+        if (!source && vm)
+        {
+            BoundState& boundState = *static_cast<BoundState*>(wrenGetUserData(vm));
+            bindDeferred(vm, boundState, baseModule.c_str());
+            if (hasClass(boundState.own, baseModule, baseClass))
+            {
+                source = &boundState.own;
+            }
+            for (auto it = boundState.shared.begin(); !source && it != boundState.shared.end(); ++it)
+            {
+                if (hasClass(**it, baseModule, baseClass))
+                {
+                    source = *it;
+                }
+            }
+        }
+        if (!source)
+        {
+            throw std::logic_error(mod + "." + clss + " inherits from " + baseModule + "." + baseClass +
+                                   ", which isn't bound");
+        }
+
+        auto module = source->modules.find(baseModule);
+        if (module == source->modules.end())
+        {
+            return;
+        }
+        // copied, since declaring the derived class's methods may move the base's declaration
+        std::vector<std::pair<bool, std::string> > methods;
+        for (const ClassDeclaration& c : module->second.classes)
+        {
+            if (c.name == baseClass)
+            {
+                methods = c.methods;
+            }
+        }
+        for (const auto& method : methods)
+        {
+            // static methods aren't inherited in Wren
+            if (method.first)
+            {
+                continue;
+            }
+            const std::uint64_t hash = hashMethodSignature(baseModule.c_str(), baseClass.c_str(), false,
+                                                           method.second.c_str());
+            if (const MethodBinding* binding = source->methods.find(hash, baseModule.c_str(), baseClass.c_str(),
+                                                                   false, method.second.c_str()))
+            {
+                MethodBinding inherited = *binding;
+                inherited.inherited     = true;
+                registerMethod(table, mod, clss, false, method.second, inherited);
+            }
+        }
+    }
+
+    // Indexed by derived type id, then by base type id. Rows are as long as the largest base
+    // type id they hold, so a lookup is two index operations.
+    using UpcastTable = std::vector<std::vector<std::ptrdiff_t> >;
+
+    // Readers use the published table without locking, while VMs run on other threads.
+    // Registering a new upcast publishes a changed copy, and keeps the tables it replaced, since
+    // readers may still be using them. Classes are bound again in each VM, so registering an
+    // upcast which the table already holds changes nothing, and copies nothing.
+    struct Upcasts
+    {
+        std::mutex                                 mutex {};
+        std::atomic<const UpcastTable*>            published {nullptr};
+        std::vector<std::unique_ptr<UpcastTable> > tables {};
+    };
+
+    Upcasts& upcasts()
+    {
+        static Upcasts upcasts {};
+        return upcasts;
+    }
+
+    void setUpcast(UpcastTable& table, std::uint32_t derived, std::uint32_t base, std::ptrdiff_t offset)
+    {
+        if (table.size() <= derived)
+        {
+            table.resize(derived + 1u);
+        }
+        if (table[derived].size() <= base)
+        {
+            table[derived].resize(base + 1u, noUpcast);
+        }
+        table[derived][base] = offset;
+    }
+
+    void registerUpcast(std::uint32_t derived, std::uint32_t base, std::ptrdiff_t offset)
+    {
+        Upcasts&                    upcasts = detail::upcasts();
+        std::lock_guard<std::mutex> lock(upcasts.mutex);
+        const UpcastTable*          current = upcasts.published.load(std::memory_order_relaxed);
+        if (current && derived < current->size() && base < (*current)[derived].size() &&
+            (*current)[derived][base] == offset)
+        {
+            // the table already holds this upcast, along with the ones it implies
+            return;
+        }
+        std::unique_ptr<UpcastTable> copy(current ? new UpcastTable(*current) : new UpcastTable());
+        UpcastTable&                table = *copy;
+        setUpcast(table, derived, base, offset);
+
+        // derived reaches base's bases, and derived's derived classes reach base
+        std::vector<std::pair<std::uint32_t, std::ptrdiff_t> > bases {{base, 0}};
+        if (base < table.size())
+        {
+            for (std::uint32_t b = 0u; b < table[base].size(); ++b)
+            {
+                if (table[base][b] != noUpcast)
+                {
+                    bases.emplace_back(b, table[base][b]);
+                }
+            }
+        }
+        for (const auto& b : bases)
+        {
+            setUpcast(table, derived, b.first, offset + b.second);
+        }
+        for (std::uint32_t d = 0u; d < table.size(); ++d)
+        {
+            if (derived < table[d].size() && table[d][derived] != noUpcast)
+            {
+                const std::ptrdiff_t toDerived = table[d][derived];
+                for (const auto& b : bases)
+                {
+                    setUpcast(table, d, b.first, toDerived + offset + b.second);
+                }
+            }
+        }
+
+        upcasts.published.store(copy.get(), std::memory_order_release);
+        upcasts.tables.push_back(std::move(copy));
+    }
+
+    std::ptrdiff_t upcastOffset(std::uint32_t derived, std::uint32_t base)
+    {
+        const UpcastTable* table = upcasts().published.load(std::memory_order_acquire);
+        if (table && derived < table->size() && base < (*table)[derived].size())
+        {
+            return (*table)[derived][base];
+        }
+        return noUpcast;
+    }
+
+    TypeCensus& typeCensus(WrenVM* vm, std::uint32_t typeId)
+    {
+        std::deque<TypeCensus>& census = static_cast<BoundState*>(wrenGetUserData(vm))->census;
+        if (census.size() <= typeId)
+        {
+            census.resize(typeId + 1u);
+        }
+        return census[typeId];
+    }
+
+    std::uint32_t censusTypes(WrenVM* vm)
+    {
+        return static_cast<std::uint32_t>(static_cast<BoundState*>(wrenGetUserData(vm))->census.size());
+    }
+
+    std::atomic<bool> tracing {false};
+
+    void traceEvent(const char* name, char phase)
+    {
+        TraceBuffer&      buffer = threadTraceBuffer();
+        const std::size_t size   = buffer.size.load(std::memory_order_relaxed);
+        if (size == WRENPP_TRACE_EVENTS)
+        {
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        buffer.events[size] =
+            TraceEvent {name,
+                        static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()),
+                        phase};
+        buffer.size.store(size + 1u, std::memory_order_release);
+    }
+
+    const FunctorBinding& vmFunctor(WrenVM* vm, std::size_t index)
+    {
+        return *static_cast<BoundState*>(wrenGetUserData(vm))->functors[index];
+    }
+
+    const char* functionTraceName(WrenVM* vm, WrenForeignMethodFn function)
+    {
+        auto*       boundState = static_cast<BoundState*>(wrenGetUserData(vm));
+        const char*& name      = boundState->traceNames[function];
+        if (name == nullptr)
+        {
+            name = internName(functionName(*boundState, function));
+        }
+        return name;
+    }
+
+    const char* callSiteTraceName(const CallSite& site)
+    {
+        if (site.traced == nullptr)
+        {
+            site.traced = internName(site.name);
+        }
+        return site.traced;
+    }
+
+    void recordCall(WrenVM* vm, const CallSite* site, int arity)
+    {
+        Recorder* recorder = static_cast<BoundState*>(wrenGetUserData(vm))->recorder.get();
+        if (recorder && site)
+        {
+            recorder->called(vm, site, arity);
+        }
+    }
+
+    WrenHandle* closureCallHandle(WrenVM* vm, std::size_t arity)
+    {
+        std::string signature = "call(";
+        for (std::size_t i = 0u; i < arity; ++i)
+        {
+            signature += i == 0u ? "_" : ",_";
+        }
+        signature += ')';
+        return static_cast<BoundState*>(wrenGetUserData(vm))->handles.callHandle(vm, signature);
+    }
+
+    void releaseHandle(WrenVM* vm, WrenHandle* handle)
+    {
+        static_cast<BoundState*>(wrenGetUserData(vm))->handles.release(vm, handle);
+    }
+
+    void registerRecordableType(std::uint32_t typeId, std::size_t size,
+                                void (*restore)(WrenVM* vm, int slot, const void* bytes))
+    {
+        RecordableTypes&            recordable = recordableTypes();
+        std::lock_guard<std::mutex> lock(recordable.mutex);
+        if (recordable.types.size() <= typeId)
+        {
+            recordable.types.resize(typeId + 1u, RecordableType {0u, nullptr});
+        }
+        recordable.types[typeId] = RecordableType {size, restore};
+    }
+
+    const char* internName(const std::string& name)
+    {
+        static std::mutex                      mutex;
+        static std::unordered_set<std::string> names;
+        std::lock_guard<std::mutex>            lock(mutex);
+        // elements of an unordered_set never move
+        return names.insert(name).first->c_str();
+    }
+
+#if defined(WRENPP_PROFILE)
+    CallProfile* callProfile(WrenVM* vm)
+    {
+        auto* boundState = static_cast<BoundState*>(wrenGetUserData(vm));
+        return boundState->profiling ? &boundState->profile : nullptr;
+    }
+
+    void recordCall(CallProfile* profile, WrenForeignMethodFn function, std::chrono::nanoseconds duration)
+    {
+        CallProfile::Stats& stats = profile->stats[function];
+        std::uint64_t       ns    = static_cast<std::uint64_t>(duration.count());
+        std::size_t         log2  = 0u;
+        while ((ns >> (log2 + 1u)) != 0u && log2 + 1u < stats.histogram.size())
+        {
+            ++log2;
+        }
+        ++stats.calls;
+        stats.totalNanoseconds += ns;
+        ++stats.histogram[log2];
+    }
+#endif
+
+    BindingTable& boundTable(WrenVM* vm)
+    {
+        return static_cast<BoundState*>(wrenGetUserData(vm))->own;
+    }
+
+    BindingTable& publishedTable()
+    {
+        static BindingTable table {};
+        return table;
+    }
+
+    void addKernel(float* dst, const float* src, std::size_t count)
+    {
+        addImpl(dst, src, count);
+    }
+
+    void addKernel(double* dst, const double* src, std::size_t count)
+    {
+        addImpl(dst, src, count);
+    }
+
+    void mulKernel(float* dst, const float* src, std::size_t count)
+    {
+        mulImpl(dst, src, count);
+    }
+
+    void mulKernel(double* dst, const double* src, std::size_t count)
+    {
+        mulImpl(dst, src, count);
+    }
+
+    void fmaKernel(float* dst, const float* a, const float* b, std::size_t count)
+    {
+        fmaImpl(dst, a, b, count);
+    }
+
+    void fmaKernel(double* dst, const double* a, const double* b, std::size_t count)
+    {
+        fmaImpl(dst, a, b, count);
+    }
+
+    void scaleKernel(float* dst, float factor, std::size_t count)
+    {
+        scaleImpl(dst, factor, count);
+    }
+
+    void scaleKernel(double* dst, double factor, std::size_t count)
+    {
+        scaleImpl(dst, factor, count);
+    }
+
+    float dotKernel(const float* a, const float* b, std::size_t count)
+    {
+        return dotImpl(a, b, count);
+    }
+
+    double dotKernel(const double* a, const double* b, std::size_t count)
+    {
+        return dotImpl(a, b, count);
+    }
+
+    float sumKernel(const float* src, std::size_t count)
+    {
+        return sumImpl(src, count);
+    }
+
+    double sumKernel(const double* src, std::size_t count)
+    {
+        return sumImpl(src, count);
+    }
+
+    float minKernel(const float* src, std::size_t count)
+    {
+        return minImpl(src, count);
+    }
+
+    double minKernel(const double* src, std::size_t count)
+    {
+        return minImpl(src, count);
+    }
+
+    float maxKernel(const float* src, std::size_t count)
+    {
+        return maxImpl(src, count);
+    }
+
+    double maxKernel(const double* src, std::size_t count)
+    {
+        return maxImpl(src, count);
+    }
+
+    /// Owns a read-only mapping of a whole file.
+    class FileMapping
+    {
+    public:
+        explicit FileMapping(const std::string& path)
+        {
+#if defined(_WIN32)
+            _file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (_file == INVALID_HANDLE_VALUE)
+            {
+                throw std::runtime_error("unable to open " + path);
+            }
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(_file, &size))
+            {
+                CloseHandle(_file);
+                throw std::runtime_error("unable to read the size of " + path);
+            }
+            _size = std::size_t(size.QuadPart);
+            if (_size != 0u)
+            {
+                _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if (_mapping == nullptr)
+                {
+                    CloseHandle(_file);
+                    throw std::runtime_error("unable to map " + path);
+                }
+                _data = static_cast<const std::uint8_t*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+                if (_data == nullptr)
+                {
+                    CloseHandle(_mapping);
+                    CloseHandle(_file);
+                    throw std::runtime_error("unable to map " + path);
+                }
+            }
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd == -1)
+            {
+                throw std::runtime_error("unable to open " + path);
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0)
+            {
+                close(fd);
+                throw std::runtime_error("unable to read the size of " + path);
+            }
+            _size = std::size_t(info.st_size);
+            if (_size != 0u)
+            {
+                void* memory = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+                if (memory == MAP_FAILED)
+                {
+                    close(fd);
+                    throw std::runtime_error("unable to map " + path);
+                }
+                _data = static_cast<const std::uint8_t*>(memory);
+            }
+            // the mapping stays valid after the descriptor is closed
+            close(fd);
+#endif
+        }
+
+        FileMapping(const FileMapping&) = delete;
+        FileMapping& operator=(const FileMapping&) = delete;
+
+        ~FileMapping()
+        {
+#if defined(_WIN32)
+            if (_data)
+            {
+                UnmapViewOfFile(_data);
+            }
+            if (_mapping)
+            {
+                CloseHandle(_mapping);
+            }
+            CloseHandle(_file);
+#else
+            if (_data)
+            {
+                munmap(const_cast<std::uint8_t*>(_data), _size);
+            }
+#endif
+        }
+
+        const std::uint8_t* data() const
+        {
+            return _data;
+        }
+
+        std::size_t size() const
+        {
+            return _size;
+        }
+
+    private:
+#if defined(_WIN32)
+        HANDLE _file {INVALID_HANDLE_VALUE};
+        HANDLE _mapping {nullptr};
+#endif
+        const std::uint8_t* _data {nullptr};
+        std::size_t         _size {0u};
+    };
+
+    // Returns the named channel's queue, creating it if no Channel currently refers to it.
+    std::shared_ptr<BoundedQueue<ChannelMessage> > openChannel(const std::string& name, std::size_t capacity)
+    {
+        using Queue = BoundedQueue<ChannelMessage>;
+        static std::mutex                                           mutex;
+        static std::unordered_map<std::string, std::weak_ptr<Queue> > queues;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto                        it = queues.find(name);
+        if (it != queues.end())
+        {
+            if (std::shared_ptr<Queue> queue = it->second.lock())
+            {
+                return queue;
+            }
+        }
+        // entries of channels which nothing holds open any more are dropped here, like those of
+        // released file mappings
+        for (it = queues.begin(); it != queues.end();)
+        {
+            it = it->second.expired() ? queues.erase(it) : std::next(it);
+        }
+        std::shared_ptr<Queue> queue = std::make_shared<Queue>(capacity);
+        queues[name]                 = queue;
+        return queue;
+    }
+
+    // Returns the process-wide mapping of the file, mapping it if no view is currently open.
+    std::shared_ptr<const FileMapping> openMapping(const std::string& path)
+    {
+        static std::mutex                                                      mutex;
+        static std::unordered_map<std::string, std::weak_ptr<const FileMapping> > mappings;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto                        it = mappings.find(path);
+        if (it != mappings.end())
+        {
+            if (std::shared_ptr<const FileMapping> mapping = it->second.lock())
+            {
+                return mapping;
+            }
+        }
+        // entries of files whose last view has been released are dropped here, so the registry
+        // only grows with the number of files mapped at once
+        for (it = mappings.begin(); it != mappings.end();)
+        {
+            it = it->second.expired() ? mappings.erase(it) : std::next(it);
+        }
+        std::shared_ptr<const FileMapping> mapping = std::make_shared<const FileMapping>(path);
+        mappings[path]                             = mapping;
+        return mapping;
+    }
+}
+
+Value null = Value();
+
+Value::Value(bool val)
+    : _type {WREN_TYPE_BOOL}
+    , _string {nullptr}
+{
+    set(val);
+}
+
+Value::Value(float val)
+    : _type {WREN_TYPE_NUM}
+    , _string {nullptr}
+{
+    set(val);
+}
+
+Value::Value(double val)
+    : _type {WREN_TYPE_NUM}
+    , _string {nullptr}
+{
+    set(val);
+}
+
+Value::Value(int val)
+    : _type {WREN_TYPE_NUM}
+    , _string {nullptr}
+{
+    set(val);
+}
+
+Value::Value(unsigned int val)
+    : _type {WREN_TYPE_NUM}
+    , _string {nullptr}
+{
+    set(val);
+}
+
+Value::Value(const char* str)
+    : _type {WREN_TYPE_STRING}
+    , _string {nullptr}
+{
+    _string = static_cast<char*>(VM::reallocateFn(nullptr, std::strlen(str) + 1));
+    std::strcpy(_string, str);
+}
+
+Value::Value(const Value& value)
+    : _type {value._type}
+    , _string {nullptr}
+{
+    std::memcpy(_storage, value._storage, sizeof(_storage));
+    if (value._string)
+    {
+        _string = static_cast<char*>(VM::reallocateFn(nullptr, std::strlen(value._string) + 1));
+        std::strcpy(_string, value._string);
+    }
+}
+
+Value::Value(Value&& value)
+    : _type {value._type}
+    , _string {value._string}
+{
+    std::memcpy(_storage, value._storage, sizeof(_storage));
+    value._string = nullptr;
+}
+
+Value& Value::operator=(const Value& rhs)
+{
+    if (&rhs != this)
+    {
+        Value copy(rhs);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+Value& Value::operator=(Value&& rhs)
+{
+    if (&rhs != this)
+    {
+        if (_string)
+        {
+            VM::reallocateFn(_string, 0u);
+        }
+        _type       = rhs._type;
+        _string     = rhs._string;
+        rhs._string = nullptr;
+        std::memcpy(_storage, rhs._storage, sizeof(_storage));
+    }
+    return *this;
+}
+
+Value::~Value()
+{
+    if (_string)
+    {
+        VM::reallocateFn(_string, 0u);
+    }
+}
+
+Method::Method(VM* vm, WrenHandle* variable, WrenHandle* method, const detail::CallSite* site)
+    : _vm(vm)
+    , _method(method)
+    , _variable(variable)
+    , _site(site)
+{
+}
+
+Method::Method(Method&& other)
+    : _vm(other._vm)
+    , _method(other._method)
+    , _variable(other._variable)
+    , _site(other._site)
+{
+    other._vm       = nullptr;
+    other._method   = nullptr;
+    other._variable = nullptr;
+    other._site     = nullptr;
+}
+
+Method::~Method()
+{
+    release();
+}
+
+void Method::release()
+{
+    if (_vm)
+    {
+        assert(_method && _variable);
+        HandleCache& handles = static_cast<BoundState*>(wrenGetUserData(_vm->ptr()))->handles;
+        handles.release(_vm->ptr(), _method);
+        handles.release(_vm->ptr(), _variable);
+        handles.releaseSite(_site);
+        _vm   = nullptr;
+        _site = nullptr;
+    }
+}
+
+Method::operator bool() const
+{
+    return _variable != nullptr && _method != nullptr;
+}
+
+Method& Method::operator=(Method&& rhs)
+{
+    if (&rhs != this)
+    {
+        release();
+        _vm           = rhs._vm;
+        _method       = rhs._method;
+        _variable     = rhs._variable;
+        _site         = rhs._site;
+        rhs._vm       = nullptr;
+        rhs._method   = nullptr;
+        rhs._variable = nullptr;
+        rhs._site     = nullptr;
+    }
+
+    return *this;
+}
+
+CallSignature::CallSignature(VM* vm, WrenHandle* method, const detail::CallSite* site)
+    : _vm(vm)
+    , _method(method)
+    , _site(site)
+{
+}
+
+CallSignature::CallSignature(CallSignature&& other)
+    : _vm(other._vm)
+    , _method(other._method)
+    , _site(other._site)
+{
+    other._vm     = nullptr;
+    other._method = nullptr;
+    other._site   = nullptr;
+}
+
+CallSignature::~CallSignature()
+{
+    release();
+}
+
+void CallSignature::release()
+{
+    if (_vm)
+    {
+        assert(_method);
+        HandleCache& handles = static_cast<BoundState*>(wrenGetUserData(_vm->ptr()))->handles;
+        handles.release(_vm->ptr(), _method);
+        handles.releaseSite(_site);
+        _vm   = nullptr;
+        _site = nullptr;
+    }
+}
+
+CallSignature::operator bool() const
+{
+    return _method != nullptr;
+}
+
+CallSignature& CallSignature::operator=(CallSignature&& rhs)
+{
+    if (&rhs != this)
+    {
+        release();
+        _vm         = rhs._vm;
+        _method     = rhs._method;
+        _site       = rhs._site;
+        rhs._vm     = nullptr;
+        rhs._method = nullptr;
+        rhs._site   = nullptr;
+    }
+
+    return *this;
+}
+
+ClassContext ModuleContext::beginClass(std::string c)
+{
+    _bindings->declaration(_name, c);
+    return ClassContext(c, *this);
+}
+
+ModuleContext& ModuleContext::generateDeclarations()
+{
+    detail::generateDeclarations(*_bindings, _name);
+    return *this;
+}
+
+RegisteredClassContext<MappedFile> ModuleContext::bindMappedFile(std::string className)
+{
+    return bindClass<MappedFile, std::string>(className, "open")
+        .bindMethod<decltype(&MappedFile::count), &MappedFile::count>(false, "count")
+        .bindMethod<decltype(&MappedFile::u8), &MappedFile::u8>(false, "u8(_)")
+        .bindMethod<decltype(&MappedFile::u16), &MappedFile::u16>(false, "u16(_)")
+        .bindMethod<decltype(&MappedFile::u32), &MappedFile::u32>(false, "u32(_)")
+        .bindMethod<decltype(&MappedFile::f32), &MappedFile::f32>(false, "f32(_)")
+        .bindMethod<decltype(&MappedFile::f64), &MappedFile::f64>(false, "f64(_)")
+        .bindMethod<decltype(&MappedFile::slice), &MappedFile::slice>(false, "slice(_,_)");
+}
+
+void ModuleContext::endModule() {}
+
+ModuleContext& ClassContext::endClass()
+{
+    return _module;
+}
+
+ClassContext::ClassContext(std::string c, ModuleContext& mod)
+    : _module(mod)
+    , _class(c)
+{
+}
+
+ClassContext& ClassContext::bindCFunction(bool isStatic, Signature signature, WrenForeignMethodFn function)
+{
+    detail::registerFunction(*_module._bindings, _module._name, _class, isStatic, signature, function);
+    return *this;
+}
+
+MappedFile::MappedFile(const std::string& path)
+    : _mapping {detail::openMapping(path)}
+    , _data {_mapping->data()}
+    , _size {_mapping->size()}
+{
+}
+
+MappedFile::MappedFile(std::shared_ptr<const detail::FileMapping> mapping, const std::uint8_t* data,
+                       std::size_t size)
+    : _mapping {std::move(mapping)}
+    , _data {data}
+    , _size {size}
+{
+}
+
+MappedFile MappedFile::slice(std::size_t offset, std::size_t length) const
+{
+    if (offset > _size || _size - offset < length)
+    {
+        throw std::out_of_range("slice exceeds the mapped file");
+    }
+    return MappedFile(_mapping, _data + offset, length);
+}
+
+RegisteredClassContext<ByteBuffer> ModuleContext::bindByteBuffer(std::string className)
+{
+    return bindClass<ByteBuffer>(className)
+        .bindMethod<decltype(&ByteBuffer::count), &ByteBuffer::count>(false, "count")
+        .bindMethod<decltype(&ByteBuffer::get), &ByteBuffer::get>(false, "[_]")
+        .bindMethod<decltype(&ByteBuffer::set), &ByteBuffer::set>(false, "[_]=(_)")
+        .bindMethod<decltype(&ByteBuffer::add), &ByteBuffer::add>(false, "add(_)")
+        .bindCFunction(false, "addBytes(_)", &ByteBuffer::addBytesFromWren)
+        .bindMethod<decltype(&ByteBuffer::clear), &ByteBuffer::clear>(false, "clear()")
+        .bindCFunction(false, "toString", &ByteBuffer::toStringFromWren);
+}
+
+namespace
+{
+// Finds the bytes of a string, byte buffer or string builder in the slot, without copying them.
+// Throws std::runtime_error if the slot holds a stale handle.
+bool bytesInSlot(WrenVM* vm, int slot, const char*& data, std::size_t& length)
+{
+    switch (wrenGetSlotType(vm, slot))
+    {
+        case WREN_TYPE_STRING:
+        {
+            int count = 0;
+            data      = wrenGetSlotBytes(vm, slot, &count);
+            length    = std::size_t(count);
+            return true;
+        }
+        case WREN_TYPE_FOREIGN:
+        {
+            auto* obj = static_cast<detail::ForeignObject*>(wrenGetSlotForeign(vm, slot));
+            if (obj->expired())
+            {
+                throw std::runtime_error("the object behind this handle has been removed");
+            }
+            if (obj->typeId() == detail::getTypeId<ByteBuffer>())
+            {
+                const auto& bytes = static_cast<ByteBuffer*>(obj->objectPtr())->bytes();
+                data              = reinterpret_cast<const char*>(bytes.data());
+                length            = bytes.size();
+                return true;
+            }
+            if (obj->typeId() == detail::getTypeId<StringBuilder>())
+            {
+                const std::string& text = static_cast<StringBuilder*>(obj->objectPtr())->text();
+                data                    = text.data();
+                length                  = text.size();
+                return true;
+            }
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+}  // namespace
+
+void ByteBuffer::addBytesFromWren(WrenVM* vm)
+{
+    try
+    {
+        ByteBuffer* buffer = getSlotForeign<ByteBuffer>(vm, 0);
+        if (buffer == nullptr)
+        {
+            return;
+        }
+        const char* data   = nullptr;
+        std::size_t length = 0u;
+        if (!bytesInSlot(vm, 1, data, length))
+        {
+            detail::abortFiber(vm, "only strings, byte buffers and string builders can be added as bytes");
+            return;
+        }
+        if (length == 0u)
+        {
+            return;
+        }
+        // a buffer added to itself is doubled in place, since inserting would read from storage it moves
+        if (data == reinterpret_cast<const char*>(buffer->_bytes.data()))
+        {
+            buffer->_bytes.resize(2u * length);
+            std::memcpy(buffer->_bytes.data() + length, buffer->_bytes.data(), length);
+            return;
+        }
+        buffer->append(data, length);
+    }
+    catch (const std::exception& e)
+    {
+        detail::abortFiber(vm, e.what());
+    }
+}
+
+void ByteBuffer::toStringFromWren(WrenVM* vm)
+{
+    const ByteBuffer* buffer = getSlotForeign<const ByteBuffer>(vm, 0);
+    if (buffer == nullptr)
+    {
+        return;
+    }
+    wrenSetSlotBytes(vm, 0, reinterpret_cast<const char*>(buffer->_bytes.data()), buffer->_bytes.size());
+}
+
+RegisteredClassContext<StringBuilder> ModuleContext::bindStringBuilder(std::string className)
+{
+    return bindClass<StringBuilder>(className)
+        .bindCFunction(false, "add(_)", &StringBuilder::addFromWren)
+        .bindCFunction(false, "addLine(_)", &StringBuilder::addLineFromWren)
+        .bindCFunction(false, "addFixed(_,_)", &StringBuilder::addFixedFromWren)
+        .bindCFunction(false, "padLeft(_,_)", &StringBuilder::padLeftFromWren)
+        .bindCFunction(false, "padRight(_,_)", &StringBuilder::padRightFromWren)
+        .bindMethod<decltype(&StringBuilder::reserve), &StringBuilder::reserve>(false, "reserve(_)")
+        .bindMethod<decltype(&StringBuilder::count), &StringBuilder::count>(false, "count")
+        .bindMethod<decltype(&StringBuilder::clear), &StringBuilder::clear>(false, "clear()")
+        .bindCFunction(false, "toString", &StringBuilder::toStringFromWren);
+}
+
+StringBuilder& StringBuilder::add(double number)
+{
+    // the same format as Num.toString
+    if (std::isnan(number))
+    {
+        _text += "nan";
+    }
+    else if (std::isinf(number))
+    {
+        _text += number > 0.0 ? "infinity" : "-infinity";
+    }
+    else
+    {
+        char buffer[24];
+        std::snprintf(buffer, sizeof(buffer), "%.14g", number);
+        _text += buffer;
+    }
+    return *this;
+}
+
+StringBuilder& StringBuilder::addFixed(double number, int digits)
+{
+    if (digits < 0 || digits > 20)
+    {
+        throw std::out_of_range("a fixed number can have 0 to 20 digits after the point");
+    }
+    if (!std::isfinite(number))
+    {
+        return add(number);
+    }
+    const std::size_t at     = _text.size();
+    const int         length = std::snprintf(nullptr, 0, "%.*f", digits, number);
+    _text.resize(at + std::size_t(length) + 1u);
+    std::snprintf(&_text[at], std::size_t(length) + 1u, "%.*f", digits, number);
+    _text.resize(at + std::size_t(length));
+    return *this;
+}
+
+StringBuilder& StringBuilder::pad(std::size_t start, std::size_t width, bool left)
+{
+    std::size_t codePoints = 0u;
+    for (std::size_t i = start; i < _text.size(); ++i)
+    {
+        // continuation bytes don't start a code point
+        codePoints += (static_cast<unsigned char>(_text[i]) & 0xc0u) != 0x80u;
+    }
+    if (codePoints < width)
+    {
+        if (left)
+        {
+            _text.insert(start, width - codePoints, ' ');
+        }
+        else
+        {
+            _text.append(width - codePoints, ' ');
+        }
+    }
+    return *this;
+}
+
+void StringBuilder::addSlot(WrenVM* vm, int slot)
+{
+    const char* data   = nullptr;
+    std::size_t length = 0u;
+    switch (wrenGetSlotType(vm, slot))
+    {
+        case WREN_TYPE_NUM:
+            add(wrenGetSlotDouble(vm, slot));
+            return;
+        case WREN_TYPE_BOOL:
+            _text += wrenGetSlotBool(vm, slot) ? "true" : "false";
+            return;
+        case WREN_TYPE_NULL:
+            _text += "null";
+            return;
+        default:
+            if (!bytesInSlot(vm, slot, data, length))
+            {
+                throw std::runtime_error("only strings, numbers, booleans, null, byte buffers and string builders "
+                                         "can be added; call toString on other values first");
+            }
+            // appending a builder to itself reads from the string it grows
+            if (data == _text.data())
+            {
+                _text.append(_text, 0u, length);
+                return;
+            }
+            _text.append(data, length);
+    }
+}
+
+void StringBuilder::addFromWren(WrenVM* vm)
+{
+    // slot 0 is left alone, so the builder is returned for chaining
+    try
+    {
+        if (StringBuilder* builder = getSlotForeign<StringBuilder>(vm, 0))
+        {
+            builder->addSlot(vm, 1);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        detail::abortFiber(vm, e.what());
+    }
+}
+
+void StringBuilder::addLineFromWren(WrenVM* vm)
+{
+    try
+    {
+        StringBuilder* builder = getSlotForeign<StringBuilder>(vm, 0);
+        if (builder == nullptr)
+        {
+            return;
+        }
+        builder->addSlot(vm, 1);
+        builder->_text += '\n';
+    }
+    catch (const std::exception& e)
+    {
+        detail::abortFiber(vm, e.what());
+    }
+}
+
+void StringBuilder::addFixedFromWren(WrenVM* vm)
+{
+    try
+    {
+        if (wrenGetSlotType(vm, 1) != WREN_TYPE_NUM || wrenGetSlotType(vm, 2) != WREN_TYPE_NUM)
+        {
+            throw std::runtime_error("addFixed takes a number and a count of digits");
+        }
+        // converting NaN or a count out of int's range is undefined, so those become -1, which
+        // addFixed rejects like any other count out of range
+        const double digits = wrenGetSlotDouble(vm, 2);
+        if (StringBuilder* builder = getSlotForeign<StringBuilder>(vm, 0))
+        {
+            builder->addFixed(wrenGetSlotDouble(vm, 1), digits >= 0.0 && digits <= 20.0 ? int(digits) : -1);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        detail::abortFiber(vm, e.what());
+    }
+}
+
+void StringBuilder::padFromWren(WrenVM* vm, bool left)
+{
+    try
+    {
+        // checked before converting, since converting NaN or a width out of range is undefined;
+        // NaN fails both comparisons, and Wren strings can't be longer than 2^32 - 1 bytes anyway
+        const double width = wrenGetSlotType(vm, 2) == WREN_TYPE_NUM ? wrenGetSlotDouble(vm, 2) : -1.0;
+        if (!(width >= 0.0 && width <= double(std::numeric_limits<std::uint32_t>::max())))
+        {
+            throw std::runtime_error("the width to pad to must be a number from 0 to 2^32 - 1");
+        }
+        StringBuilder* builder = getSlotForeign<StringBuilder>(vm, 0);
+        if (builder == nullptr)
+        {
+            return;
+        }
+        const std::size_t start = builder->count();
+        builder->addSlot(vm, 1);
+        builder->pad(start, std::size_t(width), left);
+    }
+    catch (const std::exception& e)
+    {
+        detail::abortFiber(vm, e.what());
+    }
+}
+
+void StringBuilder::padLeftFromWren(WrenVM* vm)
+{
+    padFromWren(vm, true);
+}
+
+void StringBuilder::padRightFromWren(WrenVM* vm)
+{
+    padFromWren(vm, false);
+}
+
+void StringBuilder::toStringFromWren(WrenVM* vm)
+{
+    const StringBuilder* builder = getSlotForeign<const StringBuilder>(vm, 0);
+    if (builder == nullptr)
+    {
+        return;
+    }
+    wrenSetSlotBytes(vm, 0, builder->_text.data(), builder->_text.size());
+}
+
+RegisteredClassContext<Channel> ModuleContext::bindChannel(std::string className)
+{
+    return bindClass<Channel, std::string, std::size_t>(className, "open")
+        .bindCFunction(false, "send(_)", &Channel::sendFromWren)
+        .bindCFunction(false, "poll()", &Channel::pollFromWren)
+        .bindCFunction(false, "received", &Channel::receivedFromWren);
+}
+
+Channel::Channel(const std::string& name, std::size_t capacity)
+    : _queue {detail::openChannel(name, capacity)}
+{
+}
+
+Channel::Channel(std::size_t capacity)
+    : _queue {std::make_shared<detail::BoundedQueue<ChannelMessage> >(capacity)}
+{
+}
+
+void Channel::sendFromWren(WrenVM* vm)
+{
+    Channel* channel = getSlotForeign<Channel>(vm, 0);
+    if (channel == nullptr)
+    {
+        return;
+    }
+    ByteBuffer*    buffer = nullptr;
+    ChannelMessage message {};
+    switch (wrenGetSlotType(vm, 1))
+    {
+        case WREN_TYPE_NULL:
+            break;
+        case WREN_TYPE_BOOL:
+            message.type   = ChannelMessage::Type::Bool;
+            message.number = wrenGetSlotBool(vm, 1) ? 1.0 : 0.0;
+            break;
+        case WREN_TYPE_NUM:
+            message.type   = ChannelMessage::Type::Number;
+            message.number = wrenGetSlotDouble(vm, 1);
+            break;
+        case WREN_TYPE_STRING:
+        {
+            int         length = 0;
+            const char* bytes  = wrenGetSlotBytes(vm, 1, &length);
+            message.type       = ChannelMessage::Type::String;
+            message.bytes.assign(bytes, bytes + length);
+            break;
+        }
+        case WREN_TYPE_FOREIGN:
+        {
+            auto* obj = static_cast<detail::ForeignObject*>(wrenGetSlotForeign(vm, 1));
+            if (obj->typeId() == detail::getTypeId<ByteBuffer>())
+            {
+                const ByteBuffer* bytes = getSlotForeign<const ByteBuffer>(vm, 1);
+                if (bytes == nullptr)
+                {
+                    return;
+                }
+                message.type = ChannelMessage::Type::Bytes;
+                if (obj->readOnly())
+                {
+                    // read-only buffers are sent as a copy
+                    message.bytes = bytes->bytes();
+                    break;
+                }
+                // the receiver takes over the bytes, leaving the sender's buffer empty
+                buffer        = getSlotForeign<ByteBuffer>(vm, 1);
+                message.bytes = std::move(buffer->bytes());
+                break;
+            }
+        }
+        // fall through
+        default:
+            detail::abortFiber(vm, "only null, booleans, numbers, strings and byte buffers can be sent");
+            return;
+    }
+
+    bool sent = channel->send(message);
+    if (!sent && buffer)
+    {
+        buffer->bytes() = std::move(message.bytes);
+    }
+    wrenSetSlotBool(vm, 0, sent);
+}
+
+void Channel::pollFromWren(WrenVM* vm)
+{
+    Channel* channel = getSlotForeign<Channel>(vm, 0);
+    if (channel == nullptr)
+    {
+        return;
+    }
+    wrenSetSlotBool(vm, 0, channel->receive(channel->_received));
+}
+
+void Channel::receivedFromWren(WrenVM* vm)
+{
+    Channel* channel = getSlotForeign<Channel>(vm, 0);
+    if (channel == nullptr)
+    {
+        return;
+    }
+    ChannelMessage& message = channel->_received;
+    switch (message.type)
+    {
+        case ChannelMessage::Type::Null:
+            wrenSetSlotNull(vm, 0);
+            break;
+        case ChannelMessage::Type::Bool:
+            wrenSetSlotBool(vm, 0, message.number != 0.0);
+            break;
+        case ChannelMessage::Type::Number:
+            wrenSetSlotDouble(vm, 0, message.number);
+            break;
+        case ChannelMessage::Type::String:
+            wrenSetSlotBytes(vm, 0, reinterpret_cast<const char*>(message.bytes.data()), message.bytes.size());
+            break;
+        case ChannelMessage::Type::Bytes:
+            detail::ForeignObjectValue<ByteBuffer>::setInSlot(vm, 0, ByteBuffer(std::move(message.bytes)));
+            break;
+    }
+    // a message can only be taken once
+    message.type = ChannelMessage::Type::Null;
+    message.bytes.clear();
+}
+
+namespace
+{
+// Deeper nesting is rejected, so that hostile input can't exhaust the stack or the slots.
+constexpr int MaxJsonDepth = 256;
+
+// JSON numbers are read and written in the classic locale, whatever the C locale is set to.
+// The facets work on character ranges directly, so numbers aren't copied to be converted.
+class ClassicNumbers
+{
+public:
+    ClassicNumbers()
+        : _format(nullptr)
+    {
+        _format.imbue(std::locale::classic());
+    }
+
+    // first..last must hold a whole number; one too large for a double becomes infinite
+    double read(const char* first, const char* last)
+    {
+        std::ios_base::iostate state = std::ios_base::goodbit;
+        double                 value = 0.0;
+        _get.get(first, last, _format, state, value);
+        if ((state & std::ios_base::failbit) && std::abs(value) == std::numeric_limits<double>::max())
+        {
+            value = std::copysign(HUGE_VAL, value);
+        }
+        return value;
+    }
+
+    // writes value as "%.*g" would, returning the end of the text, which isn't terminated
+    char* write(char* out, double value, int precision)
+    {
+        _format.precision(precision);
+        return _put.put(out, _format, ' ', value);
+    }
+
+    static ClassicNumbers& instance()
+    {
+        thread_local ClassicNumbers numbers;
+        return numbers;
+    }
+
+private:
+    // the facets' destructors are protected, since they are usually owned by a locale
+    struct Get : std::num_get<char, const char*>
+    {
+    };
+
+    struct Put : std::num_put<char, char*>
+    {
+    };
+
+    std::ios _format;
+    Get      _get;
+    Put      _put;
+};
+
+// Reads JSON text in place. Errors are thrown as std::runtime_error, naming the offset.
+class JsonCursor
+{
+public:
+    JsonCursor(const char* text, std::size_t begin, std::size_t end)
+        : _text(text)
+        , _at(text + begin)
+        , _end(text + end)
+    {
+    }
+
+    std::size_t offset() const
+    {
+        return std::size_t(_at - _text);
+    }
+
+    bool atEnd()
+    {
+        skipWhitespace();
+        return _at == _end;
+    }
+
+    // the first character of the next value or token, without consuming it
+    char peek()
+    {
+        if (atEnd())
+        {
+            fail("unexpected end of text");
+        }
+        return *_at;
+    }
+
+    bool consume(char c)
+    {
+        if (peek() != c)
+        {
+            return false;
+        }
+        ++_at;
+        return true;
+    }
+
+    void expect(char c)
+    {
+        if (!consume(c))
+        {
+            fail(std::string("expected '") + c + "'");
+        }
+    }
+
+    // an array or object has more elements if the next token is a comma, and ends at the bracket
+    bool next(char close)
+    {
+        if (consume(','))
+        {
+            return true;
+        }
+        expect(close);
+        return false;
+    }
+
+    void string(std::string& out)
+    {
+        expect('"');
+        out.clear();
+        for (;;)
+        {
+            if (_at == _end)
+            {
+                fail("unterminated string");
+            }
+            const char c = *_at++;
+            if (c == '"')
+            {
+                return;
+            }
+            if (static_cast<unsigned char>(c) < 0x20u)
+            {
+                fail("control character in string");
+            }
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (_at == _end)
+            {
+                fail("unterminated string");
+            }
+            switch (*_at++)
+            {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': appendCodePoint(out, codePoint()); break;
+                default: fail("invalid escape");
+            }
+        }
+    }
+
+    double number()
+    {
+        const char c = peek();
+        if (c != '-' && !std::isdigit(static_cast<unsigned char>(c)))
+        {
+            fail("expected a value");
+        }
+        const char* first = _at;
+        consumeIf('-');
+        if (!consumeIf('0'))
+        {
+            digits();
+        }
+        if (consumeIf('.'))
+        {
+            digits();
+        }
+        if (consumeIf('e') || consumeIf('E'))
+        {
+            consumeIf('+') || consumeIf('-');
+            digits();
+        }
+        return ClassicNumbers::instance().read(first, _at);
+    }
+
+    void literal(const char* word)
+    {
+        const std::size_t length = std::strlen(word);
+        if (std::size_t(_end - _at) < length || std::memcmp(_at, word, length) != 0)
+        {
+            fail("invalid literal");
+        }
+        _at += length;
+    }
+
+    // moves past the next value, checking it as it goes
+    void skipValue(int depth)
+    {
+        if (depth > MaxJsonDepth)
+        {
+            fail("nested too deeply");
+        }
+        switch (peek())
+        {
+            case '{':
+                ++_at;
+                if (consume('}'))
+                {
+                    return;
+                }
+                do
+                {
+                    skipString();
+                    expect(':');
+                    skipValue(depth + 1);
+                } while (next('}'));
+                return;
+            case '[':
+                ++_at;
+                if (consume(']'))
+                {
+                    return;
+                }
+                do
+                {
+                    skipValue(depth + 1);
+                } while (next(']'));
+                return;
+            case '"':
+                skipString();
+                return;
+            case 't': literal("true"); return;
+            case 'f': literal("false"); return;
+            case 'n': literal("null"); return;
+            default: number(); return;
+        }
+    }
+
+    [[noreturn]] void fail(const std::string& what) const
+    {
+        throw std::runtime_error("invalid JSON at offset " + std::to_string(offset()) + ": " + what);
+    }
+
+private:
+    bool consumeIf(char c)
+    {
+        if (_at != _end && *_at == c)
+        {
+            ++_at;
+            return true;
+        }
+        return false;
+    }
+
+    void digits()
+    {
+        if (_at == _end || !std::isdigit(static_cast<unsigned char>(*_at)))
+        {
+            fail("expected a digit");
+        }
+        while (_at != _end && std::isdigit(static_cast<unsigned char>(*_at)))
+        {
+            ++_at;
+        }
+    }
+
+    void skipWhitespace()
+    {
+        while (_at != _end && (*_at == ' ' || *_at == '\t' || *_at == '\n' || *_at == '\r'))
+        {
+            ++_at;
+        }
+    }
+
+    void skipString()
+    {
+        // reused, so skipping keys doesn't allocate once it has grown
+        thread_local std::string scratch;
+        string(scratch);
+    }
+
+    unsigned hex4()
+    {
+        if (_end - _at < 4)
+        {
+            fail("truncated escape");
+        }
+        unsigned value = 0u;
+        for (int i = 0; i < 4; ++i)
+        {
+            const char c = *_at++;
+            value <<= 4u;
+            if (c >= '0' && c <= '9')
+                value |= unsigned(c - '0');
+            else if (c >= 'a' && c <= 'f')
+                value |= unsigned(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F')
+                value |= unsigned(c - 'A' + 10);
+            else
+                fail("invalid escape");
+        }
+        return value;
+    }
+
+    // reads the digits of a \u escape, and the low half of a surrogate pair if there is one
+    unsigned codePoint()
+    {
+        const unsigned high = hex4();
+        if (high >= 0xdc00u && high <= 0xdfffu)
+        {
+            fail("unpaired surrogate");
+        }
+        if (high < 0xd800u || high > 0xdbffu)
+        {
+            return high;
+        }
+        if (_end - _at < 2 || _at[0] != '\\' || _at[1] != 'u')
+        {
+            fail("unpaired surrogate");
+        }
+        _at += 2;
+        const unsigned low = hex4();
+        if (low < 0xdc00u || low > 0xdfffu)
+        {
+            fail("unpaired surrogate");
+        }
+        return 0x10000u + ((high - 0xd800u) << 10u) + (low - 0xdc00u);
+    }
+
+    static void appendCodePoint(std::string& out, unsigned cp)
+    {
+        if (cp < 0x80u)
+        {
+            out += char(cp);
+        }
+        else if (cp < 0x800u)
+        {
+            out += char(0xc0u | (cp >> 6u));
+            out += char(0x80u | (cp & 0x3fu));
+        }
+        else if (cp < 0x10000u)
+        {
+            out += char(0xe0u | (cp >> 12u));
+            out += char(0x80u | ((cp >> 6u) & 0x3fu));
+            out += char(0x80u | (cp & 0x3fu));
+        }
+        else
+        {
+            out += char(0xf0u | (cp >> 18u));
+            out += char(0x80u | ((cp >> 12u) & 0x3fu));
+            out += char(0x80u | ((cp >> 6u) & 0x3fu));
+            out += char(0x80u | (cp & 0x3fu));
+        }
+    }
+
+    const char* _text;
+    const char* _at;
+    const char* _end;
+};
+
+// Decodes the next value into the slot. Each level of nesting uses the two slots above its
+// container, one for the key and one for the value.
+void decodeJson(WrenVM* vm, JsonCursor& cursor, std::string& scratch, int slot, int depth)
+{
+    if (depth > MaxJsonDepth)
+    {
+        cursor.fail("nested too deeply");
+    }
+    switch (cursor.peek())
+    {
+        case '{':
+            cursor.expect('{');
+            wrenEnsureSlots(vm, slot + 3);
+#if defined(WREN_VERSION_NUMBER) && WREN_VERSION_NUMBER >= 4000
+            wrenSetSlotNewMap(vm, slot);
+#else
+            wrenSetSlotNewList(vm, slot);
+#endif
+            if (cursor.consume('}'))
+            {
+                return;
+            }
+            do
+            {
+                cursor.string(scratch);
+                cursor.expect(':');
+#if defined(WREN_VERSION_NUMBER) && WREN_VERSION_NUMBER >= 4000
+                wrenSetSlotBytes(vm, slot + 1, scratch.data(), scratch.size());
+                decodeJson(vm, cursor, scratch, slot + 2, depth + 1);
+                wrenSetMapValue(vm, slot, slot + 1, slot + 2);
+#else
+                wrenSetSlotNewList(vm, slot + 1);
+                wrenSetSlotBytes(vm, slot + 2, scratch.data(), scratch.size());
+                wrenInsertInList(vm, slot + 1, -1, slot + 2);
+                decodeJson(vm, cursor, scratch, slot + 2, depth + 1);
+                wrenInsertInList(vm, slot + 1, -1, slot + 2);
+                wrenInsertInList(vm, slot, -1, slot + 1);
+#endif
+            } while (cursor.next('}'));
+            return;
+        case '[':
+            cursor.expect('[');
+            wrenEnsureSlots(vm, slot + 2);
+            wrenSetSlotNewList(vm, slot);
+            if (cursor.consume(']'))
+            {
+                return;
+            }
+            do
+            {
+                decodeJson(vm, cursor, scratch, slot + 1, depth + 1);
+                wrenInsertInList(vm, slot, -1, slot + 1);
+            } while (cursor.next(']'));
+            return;
+        case '"':
+            cursor.string(scratch);
+            wrenSetSlotBytes(vm, slot, scratch.data(), scratch.size());
+            return;
+        case 't':
+            cursor.literal("true");
+            wrenSetSlotBool(vm, slot, true);
+            return;
+        case 'f':
+            cursor.literal("false");
+            wrenSetSlotBool(vm, slot, false);
+            return;
+        case 'n':
+            cursor.literal("null");
+            wrenSetSlotNull(vm, slot);
+            return;
+        default:
+            wrenSetSlotDouble(vm, slot, cursor.number());
+            return;
+    }
+}
+
+// Writes the value in the slot, using the slot above it for list elements.
+void writeJson(WrenVM* vm, JsonWriter& writer, int slot, int depth)
+{
+    switch (wrenGetSlotType(vm, slot))
+    {
+        case WREN_TYPE_NULL:
+            writer.null();
+            return;
+        case WREN_TYPE_BOOL:
+            writer.boolean(wrenGetSlotBool(vm, slot));
+            return;
+        case WREN_TYPE_NUM:
+            writer.number(wrenGetSlotDouble(vm, slot));
+            return;
+        case WREN_TYPE_STRING:
+        {
+            int         length = 0;
+            const char* text   = wrenGetSlotBytes(vm, slot, &length);
+            writer.string(text, std::size_t(length));
+            return;
+        }
+        case WREN_TYPE_LIST:
+        {
+            if (depth > MaxJsonDepth)
+            {
+                throw std::runtime_error("lists are nested too deeply to write, or contain themselves");
+            }
+            const int count = wrenGetListCount(vm, slot);
+            wrenEnsureSlots(vm, slot + 2);
+            writer.beginArray();
+            for (int i = 0; i < count; ++i)
+            {
+                wrenGetListElement(vm, slot, i, slot + 1);
+                writeJson(vm, writer, slot + 1, depth + 1);
+            }
+            writer.endArray();
+            return;
+        }
+        case WREN_TYPE_FOREIGN:
+        {
+            auto* obj = static_cast<detail::ForeignObject*>(wrenGetSlotForeign(vm, slot));
+            if (obj->typeId() == detail::getTypeId<JsonDocument>())
+            {
+                const std::string text = static_cast<JsonDocument*>(obj->objectPtr())->text();
+                writer.raw(text.data(), text.size());
+                return;
+            }
+        }
+        // fall through
+        default:
+            throw std::runtime_error(
+                "only null, booleans, numbers, strings, lists and JSON documents can be written; "
+                "write maps with beginObject, key and endObject");
+    }
+}
+
+// Decodes the value between begin and end into slot 0, or a document if it's a container.
+void setJsonInSlot(WrenVM* vm, const std::shared_ptr<const std::string>& text, std::size_t begin, std::size_t end,
+                   bool decode)
+{
+    JsonCursor cursor(text->data(), begin, end);
+    const char first = cursor.peek();
+    if (!decode && (first == '{' || first == '['))
+    {
+        detail::ForeignObjectValue<JsonDocument>::setInSlot(vm, 0, JsonDocument(text, begin, end));
+        return;
+    }
+    std::string scratch;
+    decodeJson(vm, cursor, scratch, 0, 0);
+}
+
+// the string in the slot, which must be the path argument of a foreign method
+std::string pathInSlot(WrenVM* vm, int slot)
+{
+    if (wrenGetSlotType(vm, slot) != WREN_TYPE_STRING)
+    {
+        throw std::runtime_error("a JSON path must be a string");
+    }
+    int         length = 0;
+    const char* path   = wrenGetSlotBytes(vm, slot, &length);
+    return std::string(path, std::size_t(length));
+}
+
+void parseFromWren(WrenVM* vm)
+{
+    try
+    {
+        if (wrenGetSlotType(vm, 1) != WREN_TYPE_STRING)
+        {
+            throw std::runtime_error("only strings can be parsed as JSON");
+        }
+        int         length = 0;
+        const char* text   = wrenGetSlotBytes(vm, 1, &length);
+        JsonCursor  cursor(text, 0u, std::size_t(length));
+        std::string scratch;
+        decodeJson(vm, cursor, scratch, 0, 0);
+        if (!cursor.atEnd())
+        {
+            cursor.fail("expected the end of the text");
+        }
+    }
+    catch (const std::exception& e)
+    {
+        detail::abortFiber(vm, e.what());
+    }
+}
+
+void stringifyFromWren(WrenVM* vm)
+{
+    // reused, so that stringifying stops allocating once the buffer has grown
+    thread_local JsonWriter writer;
+    writer.clear();
+    try
+    {
+        writeJson(vm, writer, 1, 0);
+    }
+    catch (const std::exception& e)
+    {
+        detail::abortFiber(vm, e.what());
+        return;
+    }
+    wrenSetSlotBytes(vm, 0, writer.text().data(), writer.count());
+}
+}  // namespace
+
+ClassContext ModuleContext::bindJson(std::string className)
+{
+    return beginClass(className)
+        .bindCFunction(true, "parse(_)", &parseFromWren)
+        .bindCFunction(true, "stringify(_)", &stringifyFromWren);
+}
+
+RegisteredClassContext<JsonDocument> ModuleContext::bindJsonDocument(std::string className)
+{
+    return bindClass<JsonDocument, std::string>(className, "parse")
+        .bindCFunction(false, "[_]", &JsonDocument::getFromWren)
+        .bindMethod<decltype(&JsonDocument::has), &JsonDocument::has>(false, "has(_)")
+        .bindMethod<decltype(&JsonDocument::count), &JsonDocument::count>(false, "count(_)")
+        .bindCFunction(false, "decode(_)", &JsonDocument::decodeFromWren)
+        .bindCFunction(false, "toString", &JsonDocument::toStringFromWren);
+}
+
+RegisteredClassContext<JsonWriter> ModuleContext::bindJsonWriter(std::string className)
+{
+    return bindClass<JsonWriter>(className)
+        .bindMethod<decltype(&JsonWriter::beginObject), &JsonWriter::beginObject>(false, "beginObject()")
+        .bindMethod<decltype(&JsonWriter::endObject), &JsonWriter::endObject>(false, "endObject()")
+        .bindMethod<decltype(&JsonWriter::beginArray), &JsonWriter::beginArray>(false, "beginArray()")
+        .bindMethod<decltype(&JsonWriter::endArray), &JsonWriter::endArray>(false, "endArray()")
+        .bindMethod<void (JsonWriter::*)(const std::string&), &JsonWriter::key>(false, "key(_)")
+        .bindCFunction(false, "value(_)", &JsonWriter::valueFromWren)
+        .bindMethod<decltype(&JsonWriter::count), &JsonWriter::count>(false, "count")
+        .bindMethod<decltype(&JsonWriter::clear), &JsonWriter::clear>(false, "clear()")
+        .bindCFunction(false, "toString", &JsonWriter::toStringFromWren);
+}
+
+JsonDocument::JsonDocument(std::string text)
+    : _text {std::make_shared<const std::string>(std::move(text))}
+    , _begin {0u}
+    , _end {_text->size()}
+{
+    JsonCursor cursor(_text->data(), _begin, _end);
+    cursor.skipValue(0);
+    if (!cursor.atEnd())
+    {
+        cursor.fail("expected the end of the text");
+    }
+}
+
+JsonDocument::JsonDocument(std::shared_ptr<const std::string> text, std::size_t begin, std::size_t end)
+    : _text {std::move(text)}
+    , _begin {begin}
+    , _end {end}
+{
+}
+
+bool JsonDocument::find(const std::string& path, std::size_t& begin, std::size_t& end) const
+{
+    JsonCursor  cursor(_text->data(), _begin, _end);
+    std::string key;
+    std::size_t segment = 0u;
+    bool        more    = !path.empty();
+    while (more)
+    {
+        std::size_t dot = path.find('.', segment);
+        if (dot == std::string::npos)
+        {
+            dot  = path.size();
+            more = false;
+        }
+        const char* name   = path.data() + segment;
+        std::size_t length = dot - segment;
+        segment            = dot + 1u;
+
+        const char open = cursor.peek();
+        if (open == '{')
+        {
+            cursor.expect('{');
+            if (cursor.consume('}'))
+            {
+                return false;
+            }
+            for (;;)
+            {
+                cursor.string(key);
+                cursor.expect(':');
+                if (key.size() == length && std::memcmp(key.data(), name, length) == 0)
+                {
+                    break;
+                }
+                cursor.skipValue(0);
+                if (!cursor.next('}'))
+                {
+                    return false;
+                }
+            }
+        }
+        else if (open == '[')
+        {
+            std::size_t index = 0u;
+            for (std::size_t i = 0u; i < length; ++i)
+            {
+                if (!std::isdigit(static_cast<unsigned char>(name[i])))
+                {
+                    return false;
+                }
+                index = index * 10u + std::size_t(name[i] - '0');
+                // an array has fewer elements than the document has bytes, which also keeps a
+                // long index from overflowing
+                if (index >= _end - _begin)
+                {
+                    return false;
+                }
+            }
+            if (length == 0u)
+            {
+                return false;
+            }
+            cursor.expect('[');
+            if (cursor.consume(']'))
+            {
+                return false;
+            }
+            for (std::size_t i = 0u; i < index; ++i)
+            {
+                cursor.skipValue(0);
+                if (!cursor.next(']'))
+                {
+                    return false;
+                }
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+    cursor.peek();
+    begin = cursor.offset();
+    cursor.skipValue(0);
+    end = cursor.offset();
+    return true;
+}
+
+bool JsonDocument::has(const std::string& path) const
+{
+    std::size_t begin = 0u;
+    std::size_t end   = 0u;
+    return find(path, begin, end);
+}
+
+std::size_t JsonDocument::count(const std::string& path) const
+{
+    std::size_t begin = 0u;
+    std::size_t end   = 0u;
+    if (!find(path, begin, end))
+    {
+        throw std::out_of_range("no JSON value at \"" + path + "\"");
+    }
+    JsonCursor  cursor(_text->data(), begin, end);
+    const char  open  = cursor.peek();
+    std::size_t count = 0u;
+    if (open != '{' && open != '[')
+    {
+        throw std::runtime_error("only arrays and objects have a count");
+    }
+    cursor.expect(open);
+    const char close = open == '{' ? '}' : ']';
+    if (cursor.consume(close))
+    {
+        return 0u;
+    }
+    do
+    {
+        if (open == '{')
+        {
+            cursor.skipValue(0);
+            cursor.expect(':');
+        }
+        cursor.skipValue(0);
+        ++count;
+    } while (cursor.next(close));
+    return count;
+}
+
+JsonDocument JsonDocument::at(const std::string& path) const
+{
+    std::size_t begin = 0u;
+    std::size_t end   = 0u;
+    if (!find(path, begin, end))
+    {
+        throw std::out_of_range("no JSON value at \"" + path + "\"");
+    }
+    return JsonDocument(_text, begin, end);
+}
+
+void JsonDocument::getFromWren(WrenVM* vm)
+{
+    try
+    {
+        const JsonDocument* document = getSlotForeign<const JsonDocument>(vm, 0);
+        if (document == nullptr)
+        {
+            return;
+        }
+        std::size_t begin = 0u;
+        std::size_t end   = 0u;
+        if (!document->find(pathInSlot(vm, 1), begin, end))
+        {
+            wrenSetSlotNull(vm, 0);
+            return;
+        }
+        // copied, since the document may be collected once slot 0 is overwritten
+        const std::shared_ptr<const std::string> text = document->_text;
+        setJsonInSlot(vm, text, begin, end, false);
+    }
+    catch (const std::exception& e)
+    {
+        detail::abortFiber(vm, e.what());
+    }
+}
+
+void JsonDocument::decodeFromWren(WrenVM* vm)
+{
+    try
+    {
+        const JsonDocument* document = getSlotForeign<const JsonDocument>(vm, 0);
+        if (document == nullptr)
+        {
+            return;
+        }
+        std::size_t begin = 0u;
+        std::size_t end   = 0u;
+        if (!document->find(pathInSlot(vm, 1), begin, end))
+        {
+            wrenSetSlotNull(vm, 0);
+            return;
+        }
+        const std::shared_ptr<const std::string> text = document->_text;
+        setJsonInSlot(vm, text, begin, end, true);
+    }
+    catch (const std::exception& e)
+    {
+        detail::abortFiber(vm, e.what());
+    }
+}
+
+void JsonDocument::toStringFromWren(WrenVM* vm)
+{
+    const JsonDocument* document = getSlotForeign<const JsonDocument>(vm, 0);
+    if (document == nullptr)
+    {
+        return;
+    }
+    wrenSetSlotBytes(vm, 0, document->_text->data() + document->_begin, document->_end - document->_begin);
+}
+
+void JsonWriter::beginObject()
+{
+    beginValue();
+    _text += '{';
+    _open += '{';
+    _empty.push_back(true);
+}
+
+void JsonWriter::endObject()
+{
+    endContainer('}');
+}
+
+void JsonWriter::beginArray()
 {
-    set(val);
+    beginValue();
+    _text += '[';
+    _open += '[';
+    _empty.push_back(true);
 }
 
-Value::Value(const char* str)
-    : _type {WREN_TYPE_STRING}
-    , _string {nullptr}
+void JsonWriter::endArray()
 {
-    _string = static_cast<char*>(VM::reallocateFn(nullptr, std::strlen(str) + 1));
-    std::strcpy(_string, str);
+    endContainer(']');
 }
 
-Value::~Value()
+void JsonWriter::key(const std::string& name)
 {
-    if (_string)
+    if (_open.empty() || _open.back() != '{' || _afterKey)
     {
-        VM::reallocateFn(_string, 0u);
+        throw std::runtime_error("a key can only be written in an object, before its value");
+    }
+    if (!_empty.back())
+    {
+        _text += ',';
     }
+    _empty.back() = false;
+    escape(name.data(), name.size());
+    _text += ':';
+    _afterKey = true;
 }
 
-Method::Method(VM* vm, WrenHandle* variable, WrenHandle* method)
-    : _vm(vm)
-    , _method(method)
-    , _variable(variable)
+void JsonWriter::null()
 {
+    beginValue();
+    _text += "null";
 }
 
-Method::Method(Method&& other)
-    : _vm(other._vm)
-    , _method(other._method)
-    , _variable(other._variable)
+void JsonWriter::boolean(bool value)
 {
-    other._vm       = nullptr;
-    other._method   = nullptr;
-    other._variable = nullptr;
+    beginValue();
+    _text += value ? "true" : "false";
 }
 
-Method::~Method()
+void JsonWriter::number(double value)
 {
-    if (_vm)
+    if (!std::isfinite(value))
     {
-        assert(_method && _variable);
-        wrenReleaseHandle(_vm->ptr(), _method);
-        wrenReleaseHandle(_vm->ptr(), _variable);
+        null();
+        return;
+    }
+    beginValue();
+    // the shortest of these which reads back as the same number
+    ClassicNumbers& numbers = ClassicNumbers::instance();
+    char            buffer[32];
+    char*           end = numbers.write(buffer, value, 15);
+    if (numbers.read(buffer, end) != value)
+    {
+        end = numbers.write(buffer, value, 17);
     }
+    _text.append(buffer, end);
 }
 
-Method::operator bool() const
+void JsonWriter::string(const char* text, std::size_t length)
 {
-    return _variable != nullptr && _method != nullptr;
+    beginValue();
+    escape(text, length);
 }
 
-Method& Method::operator=(Method&& rhs)
+void JsonWriter::raw(const char* json, std::size_t length)
 {
-    if (&rhs != this)
-    {
-        _vm           = rhs._vm;
-        _method       = rhs._method;
-        _variable     = rhs._variable;
-        rhs._vm       = nullptr;
-        rhs._method   = nullptr;
-        rhs._variable = nullptr;
-    }
+    beginValue();
+    _text.append(json, length);
+}
 
-    return *this;
+void JsonWriter::clear()
+{
+    _text.clear();
+    _open.clear();
+    _empty.clear();
+    _afterKey = false;
 }
 
-ClassContext ModuleContext::beginClass(std::string c)
+void JsonWriter::beginValue()
 {
-    return ClassContext(c, *this);
+    if (_open.empty())
+    {
+        if (!_text.empty())
+        {
+            throw std::runtime_error("a JSON text has only one value at the top; clear the writer first");
+        }
+        return;
+    }
+    if (_open.back() == '{')
+    {
+        if (!_afterKey)
+        {
+            throw std::runtime_error("values in an object need a key");
+        }
+        _afterKey = false;
+        return;
+    }
+    if (!_empty.back())
+    {
+        _text += ',';
+    }
+    _empty.back() = false;
 }
 
-void ModuleContext::endModule() {}
+void JsonWriter::endContainer(char bracket)
+{
+    const char open = bracket == '}' ? '{' : '[';
+    if (_open.empty() || _open.back() != open || _afterKey)
+    {
+        throw std::runtime_error(std::string("unbalanced '") + bracket + "'");
+    }
+    _text += bracket;
+    _open.pop_back();
+    _empty.pop_back();
+}
 
-ModuleContext& ClassContext::endClass()
+void JsonWriter::escape(const char* text, std::size_t length)
 {
-    return _module;
+    static const char hex[] = "0123456789abcdef";
+    _text += '"';
+    for (std::size_t i = 0u; i < length; ++i)
+    {
+        const char c = text[i];
+        switch (c)
+        {
+            case '"': _text += "\\\""; break;
+            case '\\': _text += "\\\\"; break;
+            case '\b': _text += "\\b"; break;
+            case '\f': _text += "\\f"; break;
+            case '\n': _text += "\\n"; break;
+            case '\r': _text += "\\r"; break;
+            case '\t': _text += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20u)
+                {
+                    _text += "\\u00";
+                    _text += hex[(c >> 4) & 0xf];
+                    _text += hex[c & 0xf];
+                }
+                else
+                {
+                    _text += c;
+                }
+        }
+    }
+    _text += '"';
 }
 
-ClassContext::ClassContext(std::string c, ModuleContext& mod)
-    : _module(mod)
-    , _class(c)
+void JsonWriter::valueFromWren(WrenVM* vm)
 {
+    try
+    {
+        if (JsonWriter* writer = getSlotForeign<JsonWriter>(vm, 0))
+        {
+            writeJson(vm, *writer, 1, 0);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        detail::abortFiber(vm, e.what());
+    }
 }
 
-ClassContext& ClassContext::bindCFunction(bool isStatic, std::string signature, WrenForeignMethodFn function)
+void JsonWriter::toStringFromWren(WrenVM* vm)
 {
-    detail::registerFunction(_module._vm, _module._name, _class, isStatic, signature, function);
-    return *this;
+    const JsonWriter* writer = getSlotForeign<const JsonWriter>(vm, 0);
+    if (writer == nullptr)
+    {
+        return;
+    }
+    wrenSetSlotBytes(vm, 0, writer->_text.data(), writer->_text.size());
 }
 
 /*
@@ -240,9 +3716,9 @@ LoadModuleFn VM::loadModuleFn = [](const char* mod) -> char* {
     {
         return nullptr;
     }
-    char* buffer = static_cast<char*>(malloc(source.size()));
+    char* buffer = static_cast<char*>(malloc(source.size() + 1u));
     assert(buffer != nullptr);
-    memcpy(buffer, source.c_str(), source.size());
+    memcpy(buffer, source.c_str(), source.size() + 1u);
     return buffer;
 };
 
@@ -273,6 +3749,9 @@ std::size_t VM::chunkSize = 0x500000u;
 VM::VM()
     : _vm {nullptr}
 {
+    BoundState* boundState = new BoundState();
+    boundState->shared.push_back(&detail::publishedTable());
+
     WrenConfiguration configuration {};
     wrenInitConfiguration(&configuration);
     configuration.reallocateFn        = reallocateFnWrapper;
@@ -284,11 +3763,17 @@ VM::VM()
     configuration.bindForeignClassFn  = foreignClassProvider;
     configuration.writeFn             = writeFnWrapper;
     configuration.errorFn             = errorFnWrapper;
-    configuration.userData            = new BoundState();
+    configuration.userData            = boundState;
 
     _vm = wrenNewVM(&configuration);
 }
 
+VM::VM(const BindingSet& bindings)
+    : VM()
+{
+    useBindings(bindings);
+}
+
 VM::VM(VM&& other)
     : _vm {other._vm}
 {
@@ -309,16 +3794,30 @@ VM::~VM()
 {
     if (_vm != nullptr)
     {
-        delete static_cast<BoundState*>(wrenGetUserData(_vm));
+        // freeing the VM finalizes its foreign objects, which still count down the census
+        auto* boundState = static_cast<BoundState*>(wrenGetUserData(_vm));
+        // Wren expects every handle to be released before the VM is freed
+        boundState->handles.trim(_vm, false);
         wrenFreeVM(_vm);
+        delete boundState;
     }
 }
 
 Result VM::executeModule(const std::string& mod)
 {
-    const std::string source(loadModuleFn(mod.c_str()));
+    detail::TraceScope trace(tracedName("executeModule ", mod));
+    if (Recorder* recorder = static_cast<BoundState*>(wrenGetUserData(_vm))->recorder.get())
+    {
+        recorder->executed('M', mod, nullptr);
+    }
+    char* source = loadModuleSource(_vm, mod.c_str());
+    if (source == nullptr)
+    {
+        return Result::CompileError;
+    }
 
-    auto res = wrenInterpret(_vm, mod.c_str(), source.c_str());
+    auto res = wrenInterpret(_vm, mod.c_str(), source);
+    free(source);
 
     if (res == WrenInterpretResult::WREN_RESULT_COMPILE_ERROR)
     {
@@ -335,6 +3834,11 @@ Result VM::executeModule(const std::string& mod)
 
 Result VM::executeString(const std::string& module, const std::string& str)
 {
+    detail::TraceScope trace(tracedName("executeString ", module));
+    if (Recorder* recorder = static_cast<BoundState*>(wrenGetUserData(_vm))->recorder.get())
+    {
+        recorder->executed('S', module, &str);
+    }
     auto res = wrenInterpret(_vm, module.c_str(), str.c_str());
 
     if (res == WrenInterpretResult::WREN_RESULT_COMPILE_ERROR)
@@ -352,26 +3856,581 @@ Result VM::executeString(const std::string& module, const std::string& str)
 
 void VM::collectGarbage()
 {
+    detail::TraceScope trace("collectGarbage");
     wrenCollectGarbage(_vm);
 }
 
 Method VM::method(const std::string& mod, const std::string& var, const std::string& signature)
 {
+    // the variable is read on each lookup, so that the Method calls what it holds now
     wrenEnsureSlots(_vm, 1);
     wrenGetVariable(_vm, mod.c_str(), var.c_str(), 0);
-    WrenHandle* variable = wrenGetSlotHandle(_vm, 0);
-    WrenHandle* handle   = wrenMakeCallHandle(_vm, signature.c_str());
-    return Method(this, variable, handle);
+    WrenHandle*  variable = wrenGetSlotHandle(_vm, 0);
+    HandleCache& handles  = static_cast<BoundState*>(wrenGetUserData(_vm))->handles;
+    WrenHandle*  handle   = handles.callHandle(_vm, signature);
+    return Method(this, variable, handle, handles.callSite(mod, var, signature));
 }
 
 Method VM::method(WrenHandle* variable, const std::string& signature)
 {
-    WrenHandle* handle = wrenMakeCallHandle(_vm, signature.c_str());
-    return Method(this, variable, handle);
+    HandleCache& handles = static_cast<BoundState*>(wrenGetUserData(_vm))->handles;
+    WrenHandle*  handle  = handles.callHandle(_vm, signature);
+    return Method(this, variable, handle, handles.callSite(std::string(), std::string(), signature));
+}
+
+CallSignature VM::signature(const std::string& signature)
+{
+    HandleCache& handles = static_cast<BoundState*>(wrenGetUserData(_vm))->handles;
+    WrenHandle*  handle  = handles.callHandle(_vm, signature);
+    return CallSignature(this, handle, handles.callSite(std::string(), std::string(), signature));
+}
+
+std::size_t VM::trimHandles()
+{
+    BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(_vm));
+    return boundState->handles.trim(_vm, boundState->recorder == nullptr);
+}
+
+std::size_t VM::cachedHandles() const
+{
+    return static_cast<const BoundState*>(wrenGetUserData(_vm))->handles.size();
 }
 
 ModuleContext VM::beginModule(std::string name)
 {
     return ModuleContext(_vm, name);
 }
+
+void VM::useBindings(const BindingSet& bindings)
+{
+    static_cast<BoundState*>(wrenGetUserData(_vm))->shared.push_back(bindings._table.get());
+}
+
+void VM::deferModule(std::string name, ModuleBinder binder)
+{
+    static_cast<BoundState*>(wrenGetUserData(_vm))->deferred.emplace_back(std::move(name), std::move(binder));
+}
+
+#if defined(WRENPP_PROFILE)
+void VM::setProfiling(bool enabled)
+{
+    static_cast<BoundState*>(wrenGetUserData(_vm))->profiling = enabled;
+}
+
+std::vector<ProfileEntry> VM::profile() const
+{
+    const auto*               boundState = static_cast<const BoundState*>(wrenGetUserData(_vm));
+    std::vector<ProfileEntry> entries;
+    for (const auto& s : boundState->profile.stats)
+    {
+        entries.push_back(
+            ProfileEntry {functionName(*boundState, s.first), s.second.calls, s.second.totalNanoseconds, s.second.histogram});
+    }
+    std::sort(entries.begin(), entries.end(), [](const ProfileEntry& a, const ProfileEntry& b) {
+        return a.totalNanoseconds > b.totalNanoseconds;
+    });
+    return entries;
+}
+#else
+void VM::setProfiling(bool) {}
+
+std::vector<ProfileEntry> VM::profile() const
+{
+    return std::vector<ProfileEntry>();
+}
+#endif
+
+std::vector<CensusEntry> VM::census() const
+{
+    const auto&              census = static_cast<const BoundState*>(wrenGetUserData(_vm))->census;
+    std::vector<CensusEntry> entries;
+    for (std::uint32_t id = 0u; id < census.size(); ++id)
+    {
+        const detail::TypeCensus& c = census[id];
+        if (c.peakLive == 0u)
+        {
+            continue;
+        }
+        std::string name = id < detail::classNameStorage().size() ? detail::classNameStorage()[id] : "<unbound>";
+        entries.push_back(CensusEntry {std::move(name), c.live, c.bytes, c.peakLive, c.peakBytes});
+    }
+    std::sort(entries.begin(), entries.end(), [](const CensusEntry& a, const CensusEntry& b) {
+        return a.bytes > b.bytes;
+    });
+    return entries;
+}
+
+void VM::resetCensusPeaks()
+{
+    for (detail::TypeCensus& c : static_cast<BoundState*>(wrenGetUserData(_vm))->census)
+    {
+        c.peakLive  = c.live;
+        c.peakBytes = c.bytes;
+    }
+}
+
+void VM::startRecording(std::ostream& out)
+{
+    static_cast<BoundState*>(wrenGetUserData(_vm))->recorder.reset(new Recorder(out));
+}
+
+void VM::stopRecording()
+{
+    static_cast<BoundState*>(wrenGetUserData(_vm))->recorder.reset();
+}
+
+void Tracer::start()
+{
+    detail::tracing.store(true, std::memory_order_relaxed);
+}
+
+void Tracer::stop()
+{
+    detail::tracing.store(false, std::memory_order_relaxed);
+}
+
+void Tracer::write(std::ostream& out)
+{
+    TraceRegistry&              registry = traceRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    const char*                 separator = "";
+    out << "{\"traceEvents\":[";
+    for (const auto& buffer : registry.buffers)
+    {
+        const std::size_t size = buffer->size.load(std::memory_order_acquire);
+        for (std::size_t i = 0u; i < size; ++i)
+        {
+            const TraceEvent& event = buffer->events[i];
+            out << separator << "\n{\"name\":";
+            writeJsonString(out, event.name);
+            // timestamps are in microseconds
+            out << ",\"ph\":\"" << event.phase << "\",\"ts\":" << event.nanoseconds / 1000u << '.'
+                << std::setw(3) << std::setfill('0') << event.nanoseconds % 1000u << std::setfill(' ')
+                << ",\"pid\":1,\"tid\":" << buffer->thread << '}';
+            separator = ",";
+        }
+    }
+    out << "\n]}\n";
+    recycleTraceBuffers(registry);
+}
+
+void Tracer::clear()
+{
+    TraceRegistry&              registry = traceRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (const auto& buffer : registry.buffers)
+    {
+        buffer->size.store(0u, std::memory_order_relaxed);
+    }
+    recycleTraceBuffers(registry);
+}
+
+BindingSet::BindingSet()
+    : _table {new detail::BindingTable()}
+{
+}
+
+BindingSet::~BindingSet() = default;
+
+ModuleContext BindingSet::beginModule(std::string name)
+{
+    return ModuleContext(_table.get(), name);
+}
+
+void VM::post(std::function<void(VM&)> task)
+{
+    auto* node = new Inbox::Node();
+    node->task = std::move(task);
+    static_cast<BoundState*>(wrenGetUserData(_vm))->inbox.push(node);
+}
+
+std::size_t VM::drainInbox(std::size_t maxTasks)
+{
+    Inbox&      inbox = static_cast<BoundState*>(wrenGetUserData(_vm))->inbox;
+    std::size_t count = 0u;
+    while (count < maxTasks)
+    {
+        std::unique_ptr<Inbox::Node> node(inbox.pop());
+        if (!node)
+        {
+            break;
+        }
+        node->task(*this);
+        ++count;
+    }
+    return count;
+}
+
+VMPool::Lease::Lease(VMPool* pool, std::unique_ptr<VM> vm)
+    : _pool {pool}
+    , _vm {std::move(vm)}
+{
+}
+
+VMPool::Lease::~Lease()
+{
+    if (_vm)
+    {
+        _pool->release(std::move(_vm));
+    }
+}
+
+VMPool::VMPool(std::size_t standby, SetupFn setup)
+    : _standby {standby}
+    , _setup {std::move(setup)}
+{
+    // The first setup also registers the bound types' names, which must not race with VMs
+    // running on other threads.
+    for (std::size_t i = 0u; i < _standby; ++i)
+    {
+        _ready.push_back(create());
+    }
+    _worker = std::thread(&VMPool::run, this);
+}
+
+VMPool::~VMPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _wake.notify_one();
+    _worker.join();
+}
+
+VMPool::Lease VMPool::acquire()
+{
+    std::unique_ptr<VM> vm;
+    std::exception_ptr  failure;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_ready.empty())
+        {
+            vm = std::move(_ready.back());
+            _ready.pop_back();
+        }
+        else
+        {
+            failure  = std::move(_failure);
+            _failure = nullptr;
+        }
+    }
+    _wake.notify_one();
+    if (failure)
+    {
+        std::rethrow_exception(failure);
+    }
+    if (!vm)
+    {
+        vm = create();
+    }
+    return Lease(this, std::move(vm));
+}
+
+std::size_t VMPool::ready() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _ready.size();
+}
+
+void VMPool::release(std::unique_ptr<VM> vm)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _retired.push_back(std::move(vm));
+    }
+    _wake.notify_one();
+}
+
+std::unique_ptr<VM> VMPool::create() const
+{
+    std::unique_ptr<VM> vm(new VM());
+    _setup(*vm);
+    return vm;
+}
+
+void VMPool::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;)
+    {
+        _wake.wait(lock, [this]() {
+            return _stopping || !_retired.empty() || (_ready.size() < _standby && !_failure);
+        });
+        if (_stopping)
+        {
+            break;
+        }
+
+        // VMs are destroyed and created without holding the lock
+        std::vector<std::unique_ptr<VM> > retired;
+        retired.swap(_retired);
+        const bool refill = _ready.size() < _standby && !_failure;
+        lock.unlock();
+
+        retired.clear();
+        std::unique_ptr<VM> vm;
+        std::exception_ptr  failure;
+        if (refill)
+        {
+            // an exception escaping this thread would terminate the process
+            try
+            {
+                vm = create();
+            }
+            catch (...)
+            {
+                failure = std::current_exception();
+            }
+        }
+
+        lock.lock();
+        if (vm)
+        {
+            _ready.push_back(std::move(vm));
+        }
+        if (failure)
+        {
+            _failure = std::move(failure);
+        }
+    }
+}
+}
+
+namespace
+{
+class RecordingReader
+{
+public:
+    explicit RecordingReader(std::istream& in)
+        : _in(in)
+    {
+    }
+
+    bool atEnd()
+    {
+        return _in.peek() == std::char_traits<char>::eof();
+    }
+
+    template <typename T>
+    T get()
+    {
+        T value;
+        read(&value, sizeof(T));
+        return value;
+    }
+
+    std::string getString()
+    {
+        std::string str(get<std::uint32_t>(), '\0');
+        read(&str[0], str.size());
+        return str;
+    }
+
+    void read(void* dst, std::size_t size)
+    {
+        if (!_in.read(static_cast<char*>(dst), static_cast<std::streamsize>(size)))
+        {
+            throw std::runtime_error("malformed recording");
+        }
+    }
+
+private:
+    std::istream& _in;
+};
+
+// The variable and call handles of each recorded call site
+struct ReplayedCalls
+{
+    explicit ReplayedCalls(WrenVM* vm)
+        : vm {vm}
+    {
+    }
+
+    ~ReplayedCalls()
+    {
+        for (const auto& call : handles)
+        {
+            if (call.second.first)
+            {
+                wrenReleaseHandle(vm, call.second.first);
+            }
+            wrenReleaseHandle(vm, call.second.second);
+        }
+    }
+
+    WrenVM*                                                                 vm;
+    std::unordered_map<std::uint32_t, std::pair<WrenHandle*, WrenHandle*> > handles {};
+};
+
+struct ReplayedClass
+{
+    RecordableType type;
+    std::string    module;
+    std::string    className;
+};
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0.0;
+    }
+    std::size_t rank = static_cast<std::size_t>(std::ceil(p * static_cast<double>(sorted.size())));
+    return sorted[std::min(sorted.size(), std::max<std::size_t>(rank, 1u)) - 1u];
+}
+}
+
+namespace wrenpp
+{
+ReplayReport replay(VM& vm, std::istream& recording)
+{
+    RecordingReader reader(recording);
+    char            magic[sizeof(recordingMagic)];
+    reader.read(magic, sizeof(magic));
+    if (std::memcmp(magic, recordingMagic, sizeof(magic)) != 0)
+    {
+        throw std::runtime_error("not a recording");
+    }
+
+    WrenVM*                                          wren = vm.ptr();
+    ReplayedCalls                                    calls(wren);
+    std::unordered_map<std::uint32_t, ReplayedClass> classes;
+    std::vector<double>                              latencies;
+    ReplayReport                                     report {0u, 0u, 0u, 0.0, 0.0, 0.0, 0.0};
+
+    while (!reader.atEnd())
+    {
+        switch (reader.get<char>())
+        {
+            case 'S':
+            {
+                std::string module = reader.getString();
+                vm.executeString(module, reader.getString());
+                break;
+            }
+            case 'M':
+                vm.executeModule(reader.getString());
+                break;
+            case 'D':
+            {
+                std::uint32_t id        = reader.get<std::uint32_t>();
+                std::string   module    = reader.getString();
+                std::string   variable  = reader.getString();
+                std::string   signature = reader.getString();
+                // calls without a module have their receiver recorded with each call
+                WrenHandle* receiver = nullptr;
+                if (!module.empty())
+                {
+                    wrenEnsureSlots(wren, 1);
+                    wrenGetVariable(wren, module.c_str(), variable.c_str(), 0);
+                    receiver = wrenGetSlotHandle(wren, 0);
+                }
+                calls.handles[id] = {receiver, wrenMakeCallHandle(wren, signature.c_str())};
+                break;
+            }
+            case 'K':
+            {
+                std::uint32_t id          = reader.get<std::uint32_t>();
+                ReplayedClass c           = {RecordableType {0u, nullptr}, reader.getString(), reader.getString()};
+                auto&         classNames  = detail::classNameStorage();
+                auto&         moduleNames = detail::moduleNameStorage();
+                for (std::uint32_t typeId = 0u; typeId < classNames.size(); ++typeId)
+                {
+                    if (classNames[typeId] == c.className && moduleNames[typeId] == c.module)
+                    {
+                        c.type = recordableType(typeId);
+                    }
+                }
+                if (c.type.restore == nullptr)
+                {
+                    throw std::runtime_error("recorded class " + c.module + "." + c.className + " isn't bound");
+                }
+                classes[id] = std::move(c);
+                break;
+            }
+            case 'C':
+            {
+                auto call = calls.handles.find(reader.get<std::uint32_t>());
+                if (call == calls.handles.end())
+                {
+                    throw std::runtime_error("malformed recording");
+                }
+                const int arity   = reader.get<std::uint8_t>();
+                bool      skipped = false;
+                wrenEnsureSlots(wren, arity + 1);
+                if (call->second.first)
+                {
+                    wrenSetSlotHandle(wren, 0, call->second.first);
+                }
+                for (int slot = call->second.first ? 1 : 0; slot <= arity; ++slot)
+                {
+                    switch (reader.get<char>())
+                    {
+                        case 'n':
+                            wrenSetSlotNull(wren, slot);
+                            break;
+                        case 'b':
+                            wrenSetSlotBool(wren, slot, reader.get<std::uint8_t>() != 0u);
+                            break;
+                        case 'd':
+                            wrenSetSlotDouble(wren, slot, reader.get<double>());
+                            break;
+                        case 's':
+                        {
+                            std::string str = reader.getString();
+                            wrenSetSlotBytes(wren, slot, str.data(), str.size());
+                            break;
+                        }
+                        case 'f':
+                        {
+                            auto c = classes.find(reader.get<std::uint32_t>());
+                            if (c == classes.end())
+                            {
+                                throw std::runtime_error("malformed recording");
+                            }
+                            std::vector<char> bytes(c->second.type.size);
+                            reader.read(bytes.data(), bytes.size());
+                            c->second.type.restore(wren, slot, bytes.data());
+                            break;
+                        }
+                        case 'u':
+                            skipped = true;
+                            break;
+                        default:
+                            throw std::runtime_error("malformed recording");
+                    }
+                }
+                if (skipped)
+                {
+                    ++report.skipped;
+                    break;
+                }
+
+                auto start  = std::chrono::steady_clock::now();
+                auto result = wrenCall(wren, call->second.second);
+                auto end    = std::chrono::steady_clock::now();
+                latencies.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+                ++report.calls;
+                if (result != WREN_RESULT_SUCCESS)
+                {
+                    ++report.failed;
+                }
+                break;
+            }
+            default:
+                throw std::runtime_error("malformed recording");
+        }
+    }
+
+    for (double latency : latencies)
+    {
+        report.seconds += latency * 1e-6;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    report.p50 = percentile(latencies, 0.5);
+    report.p90 = percentile(latencies, 0.9);
+    report.p99 = percentile(latencies, 0.99);
+    return report;
+}
 }
@@ -7,18 +7,38 @@ extern "C"
 }
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <atomic>
+#include <array>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>  // for std::ptrdiff_t
 #include <cstdint>
 #include <cstdlib>  // for std::size_t
 #include <cstring>  // for memcpy, strcpy
+#include <exception>
 #include <fstream>
 #include <functional>  // for std::hash
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
 #include <vector>
 
+// keeps the functions which marshal calls to bound functions out of the per-function thunks
+#if defined(_MSC_VER)
+#define WRENPP_NOINLINE __declspec(noinline)
+#else
+#define WRENPP_NOINLINE __attribute__((noinline))
+#endif
+
 namespace wrenpp
 {
 using LoadModuleFn = std::function<char*(const char*)>;
@@ -26,6 +46,91 @@ using WriteFn      = std::function<void(const char*)>;
 using ReallocateFn = std::function<void*(void*, std::size_t)>;
 using ErrorFn      = std::function<void(WrenErrorType, const char*, int, const char*)>;
 
+class Signature;
+
+/// Refers to a host-owned T by slot and generation, rather than by address. See HandleTable.
+template <typename T>
+struct Handle
+{
+    std::uint32_t slot{0u};
+    std::uint32_t generation{0u};  // zero is never valid, so a default Handle refers to nothing
+};
+
+/// The host-owned objects of type T which Wren refers to through Handles. Removing an object
+/// changes its slot's generation, so that Wren's references to it become stale: using one is
+/// a Wren runtime error instead of a use-after-free, and the host can free or pool the object
+/// right away. Looking a handle up is an index and a comparison. There is one table per type,
+/// shared by all VMs, and it isn't synchronized: it must only be used on the thread which first
+/// used it, which debug builds assert. VMs running on other threads, such as a VMPool's, can't
+/// use Handles of T.
+template <typename T>
+class HandleTable
+{
+public:
+    static Handle<T> insert(T* object)
+    {
+        Table& table = instance();
+        if (table.free.empty())
+        {
+            table.entries.push_back(Entry{object, 1u});
+            return Handle<T>{static_cast<std::uint32_t>(table.entries.size() - 1u), 1u};
+        }
+        const std::uint32_t slot = table.free.back();
+        table.free.pop_back();
+        table.entries[slot].object = object;
+        return Handle<T>{slot, table.entries[slot].generation};
+    }
+
+    /// Makes the handle, and any copies of it, stale. Does nothing if it's already stale.
+    static void remove(Handle<T> handle)
+    {
+        Table& table = instance();
+        if (get(handle) != nullptr)
+        {
+            Entry& entry = table.entries[handle.slot];
+            entry.object = nullptr;
+            // skip zero when the generation wraps around
+            entry.generation = entry.generation + 1u == 0u ? 1u : entry.generation + 1u;
+            table.free.push_back(handle.slot);
+        }
+    }
+
+    /// the object, or nullptr if the handle is stale
+    static T* get(Handle<T> handle)
+    {
+        const Table& table = instance();
+        if (handle.slot < table.entries.size() && table.entries[handle.slot].generation == handle.generation)
+        {
+            return table.entries[handle.slot].object;
+        }
+        return nullptr;
+    }
+
+private:
+    struct Entry
+    {
+        T*            object;
+        std::uint32_t generation;
+    };
+
+    struct Table
+    {
+        std::vector<Entry>         entries;
+        std::vector<std::uint32_t> free;
+        std::thread::id            owner = std::this_thread::get_id();
+    };
+
+    static Table& instance()
+    {
+        static Table table;
+        assert(table.owner == std::this_thread::get_id() && "HandleTable used from another thread");
+        return table;
+    }
+};
+
+template <typename Signature>
+class Function;
+
 namespace detail
 {
     /// TYPEID
@@ -105,14 +210,127 @@ namespace detail
         return moduleNameStorage()[id].c_str();
     }
 
+    class ForeignObject;
+
+    /// Objects whose tracked setters or methods were called since they were last drained
+    using DirtySet = std::vector<ForeignObject*>;
+
+    /// The foreign objects of one type which are alive in a VM
+    struct TypeCensus
+    {
+        std::size_t live {0u};
+        std::size_t bytes {0u};
+        std::size_t peakLive {0u};
+        std::size_t peakBytes {0u};
+        DirtySet    dirty {};
+        // the objects which VM::drainDirty has yet to visit
+        DirtySet    draining {};
+    };
+
+    /// the VM's census of the type, which stays at the same address for the VM's lifetime
+    TypeCensus& typeCensus(WrenVM* vm, std::uint32_t typeId);
+
+    /// how many types the VM's census has room for, indexed by type id
+    std::uint32_t censusTypes(WrenVM* vm);
+
     /// The interface for getting the object pointer. The actual C++ object may lie within the Wren
     /// object, or may live in C++.
     class ForeignObject
     {
     public:
-        virtual ~ForeignObject()     = default;
+        virtual ~ForeignObject()
+        {
+            if (_dirtyState != Clean)
+            {
+                // swap the last object of the set into this one's place
+                DirtySet&      set    = dirtySet();
+                ForeignObject* last   = set.back();
+                set[_dirtyIndex]      = last;
+                last->_dirtyIndex     = _dirtyIndex;
+                set.pop_back();
+            }
+        }
         virtual void*    objectPtr() = 0;
         virtual uint32_t typeId()    = 0;
+        /// true if the object is gone, as a stale Handle's is. objectPtr throws if so.
+        virtual bool expired()
+        {
+            return false;
+        }
+        /// true if Wren may only read the object, as with published objects
+        virtual bool readOnly()
+        {
+            return false;
+        }
+        /// true if the object wraps a Handle rather than the object itself
+        virtual bool isHandle()
+        {
+            return false;
+        }
+
+        /// adds the object to the dirty set of its type in its VM, unless it's already there or
+        /// waiting to be visited by the drain in progress
+        void markDirty()
+        {
+            assert(_census && "the object isn't counted in a VM");
+            if (_dirtyState == Clean)
+            {
+                _dirtyState = Dirty;
+                _dirtyIndex = static_cast<std::uint32_t>(_census->dirty.size());
+                _census->dirty.push_back(this);
+            }
+        }
+
+        /// called for each object when its type's dirty set is moved out to be drained
+        void markDraining()
+        {
+            _dirtyState = Draining;
+        }
+
+        /// called for each object when it's taken out of the set being drained
+        void markClean()
+        {
+            _dirtyState = Clean;
+        }
+
+        /// counts the object in the VM's census until it is destroyed. The census is kept in the
+        /// object, since finalizers aren't told which VM they run in.
+        void track(WrenVM* vm, std::size_t bytes)
+        {
+            _census = &typeCensus(vm, typeId());
+            _census->live += 1u;
+            _census->bytes += bytes;
+            _census->peakLive  = std::max(_census->peakLive, _census->live);
+            _census->peakBytes = std::max(_census->peakBytes, _census->bytes);
+        }
+
+    protected:
+        void untrack(std::size_t bytes)
+        {
+            if (_census)
+            {
+                _census->live -= 1u;
+                _census->bytes -= bytes;
+            }
+        }
+
+    private:
+        enum DirtyState : std::uint8_t
+        {
+            Clean,
+            Dirty,
+            Draining
+        };
+
+        DirtySet& dirtySet()
+        {
+            return _dirtyState == Dirty ? _census->dirty : _census->draining;
+        }
+
+        // The dirty sets are kept in the census, so that an object only needs its index in one
+        TypeCensus*   _census {nullptr};
+        std::uint32_t _dirtyIndex {0u};
+        DirtyState    _dirtyState {Clean};
     };
 
     /// This wraps a class object by value. The lifetimes of these objects are managed in Wren.
@@ -129,6 +347,7 @@ namespace detail
         {
             T* obj = static_cast<T*>(objectPtr());
             obj->~T();
+            untrack(sizeof(ForeignObjectValue<T>));
         }
 
         void* objectPtr() override
@@ -149,6 +368,7 @@ namespace detail
             ForeignObjectValue<T>* val =
                 new (wrenSetSlotNewForeign(vm, slot, slot, sizeof(ForeignObjectValue<T>))) ForeignObjectValue<T>();
             new (val->objectPtr()) T{std::forward<Args>(arg)...};
+            val->track(vm, sizeof(ForeignObjectValue<T>));
         }
 
     private:
@@ -165,11 +385,15 @@ namespace detail
             : _object{object}
         {
         }
-        virtual ~ForeignObjectPtr() = default;
+        virtual ~ForeignObjectPtr()
+        {
+            untrack(sizeof(ForeignObjectPtr<T>));
+        }
 
         void* objectPtr() override
         {
-            return _object;
+            // T may be const for objects which Wren may only read
+            return const_cast<std::remove_const_t<T>*>(_object);
         }
 
         uint32_t typeId() override
@@ -177,39 +401,284 @@ namespace detail
             return getTypeId<T>();
         }
 
+        bool readOnly() override
+        {
+            return std::is_const<T>::value;
+        }
+
         static void setInSlot(WrenVM* vm, int slot, T* obj)
         {
             wrenEnsureSlots(vm, slot + 1);
             wrenGetVariable(vm, getWrenModuleString<T>(), getWrenClassString<T>(), slot);
             void* bytes = wrenSetSlotNewForeign(vm, slot, slot, sizeof(ForeignObjectPtr<T>));
-            new (bytes) ForeignObjectPtr<T>{obj};
+            (new (bytes) ForeignObjectPtr<T>{obj})->track(vm, sizeof(ForeignObjectPtr<T>));
         }
 
     private:
         T* _object;
     };
 
+    /// Wraps a Handle to a host-owned object, which the host may remove while Wren still refers
+    /// to it. Getting the object of a stale handle throws, which the bound function wrappers turn
+    /// into a runtime error.
+    template <typename T>
+    class ForeignObjectHandle : public ForeignObject
+    {
+    public:
+        explicit ForeignObjectHandle(Handle<T> handle)
+            : _handle{handle}
+        {
+        }
+        virtual ~ForeignObjectHandle()
+        {
+            untrack(sizeof(ForeignObjectHandle<T>));
+        }
+
+        void* objectPtr() override
+        {
+            if (T* object = HandleTable<T>::get(_handle))
+            {
+                return object;
+            }
+            throw std::runtime_error("the object behind this handle has been removed");
+        }
+
+        uint32_t typeId() override
+        {
+            return getTypeId<T>();
+        }
+
+        bool expired() override
+        {
+            return HandleTable<T>::get(_handle) == nullptr;
+        }
+
+        bool isHandle() override
+        {
+            return true;
+        }
+
+        Handle<T> handle() const
+        {
+            return _handle;
+        }
+
+        static void setInSlot(WrenVM* vm, int slot, Handle<T> handle)
+        {
+            wrenEnsureSlots(vm, slot + 1);
+            wrenGetVariable(vm, getWrenModuleString<T>(), getWrenClassString<T>(), slot);
+            void* bytes = wrenSetSlotNewForeign(vm, slot, slot, sizeof(ForeignObjectHandle<T>));
+            (new (bytes) ForeignObjectHandle<T>{handle})->track(vm, sizeof(ForeignObjectHandle<T>));
+        }
+
+    private:
+        Handle<T> _handle;
+    };
+
+    /// UPCASTS
+
+    constexpr std::ptrdiff_t noUpcast = PTRDIFF_MIN;
+
+    /// Records that objects of type derived may be used as objects of type base, whose address is
+    /// offset bytes from the derived object's. Also records the upcasts this implies through
+    /// the bases' and derived classes' other upcasts.
+    void registerUpcast(std::uint32_t derived, std::uint32_t base, std::ptrdiff_t offset);
+
+    /// the offset from a derived object to its base, or noUpcast if base isn't a base of derived
+    std::ptrdiff_t upcastOffset(std::uint32_t derived, std::uint32_t base);
+
+    template <typename Derived, typename Base>
+    std::ptrdiff_t baseOffset()
+    {
+        // the offset of a non-virtual base doesn't depend on the object, so any suitably aligned
+        // address will do
+        typename std::aligned_storage<sizeof(Derived), alignof(Derived)>::type storage;
+        Derived* derived = reinterpret_cast<Derived*>(&storage);
+        return reinterpret_cast<char*>(static_cast<Base*>(derived)) - reinterpret_cast<char*>(derived);
+    }
+
+    /// The foreign object as a T. Objects of classes declared to derive from T are upcast through
+    /// the upcast table, rather than with dynamic_cast. Throws if T isn't const, but the object
+    /// is read-only.
+    template <typename T>
+    T* objectAs(ForeignObject* obj)
+    {
+        if (!std::is_const<T>::value && obj->readOnly())
+        {
+            throw std::runtime_error("this object is read-only");
+        }
+        using Object            = std::remove_const_t<T>;
+        Object*             ptr = static_cast<Object*>(obj->objectPtr());
+        const std::uint32_t id  = obj->typeId();
+        if (id == getTypeId<T>() || ptr == nullptr)
+        {
+            return ptr;
+        }
+        const std::ptrdiff_t offset = upcastOffset(id, getTypeId<T>());
+        assert(offset != noUpcast && "Different type expected");
+        return reinterpret_cast<Object*>(reinterpret_cast<char*>(ptr) + offset);
+    }
+
     /// FOREIGN METHOD
 
-    /// given a Wren method signature, this returns a unique value
-    inline std::size_t hashMethodSignature(const char* module,
-                                           const char* className,
-                                           bool        isStatic,
-                                           const char* signature)
+    /// FNV-1a, usable at compile time
+    constexpr std::uint64_t hashString(const char* str, std::uint64_t hash = 14695981039346656037ull)
     {
-        std::hash<std::string> hash;
-        std::string            qualified(module);
-        qualified += className;
-        qualified += signature;
-        if (isStatic)
+        while (*str != '\0')
         {
-            qualified += 's';
+            hash = (hash ^ static_cast<unsigned char>(*str++)) * 1099511628211ull;
         }
-        return hash(qualified);
+        // 0xff can't occur in UTF-8, so it separates the parts of a signature
+        return (hash ^ 0xffu) * 1099511628211ull;
     }
 
+    // given a Wren class signature, this returns its hash
+    constexpr std::uint64_t hashClassSignature(const char* module, const char* className)
+    {
+        return hashString(className, hashString(module));
+    }
+
+    /// Combines the hash of a class with the hash of one of its method signatures, which is
+    /// computed on its own so that it can be computed at compile time. Different signatures may
+    /// collide, so lookups must compare the signature itself as well.
+    constexpr std::uint64_t hashMethodSignature(std::uint64_t classHash, bool isStatic, std::uint64_t signatureHash)
+    {
+        std::uint64_t hash = classHash ^ (isStatic ? 1u : 0u);
+        for (int shift = 0; shift < 64; shift += 8)
+        {
+            hash = (hash ^ ((signatureHash >> shift) & 0xffu)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    constexpr std::uint64_t hashMethodSignature(const char* module,
+                                                const char* className,
+                                                bool        isStatic,
+                                                const char* signature)
+    {
+        return hashMethodSignature(hashClassSignature(module, className), isStatic, hashString(signature));
+    }
+
+    // An open-addressing hash table from signatures to bindings. The full signature is kept
+    // next to the hash, so that colliding signatures can't bind each other's functions, and
+    // lookups compare it without building any strings.
+    template <typename V>
+    class SignatureMap
+    {
+    public:
+        // the first binding of a signature wins
+        void insert(std::uint64_t      hash,
+                    const std::string& module,
+                    const std::string& className,
+                    bool               isStatic,
+                    const std::string& signature,
+                    V                  value)
+        {
+            if (find(hash, module.c_str(), className.c_str(), isStatic, signature.c_str()) != nullptr)
+            {
+                return;
+            }
+            if (2u * (_size + 1u) > _slots.size())
+            {
+                grow();
+            }
+            place(Slot {hash, true, isStatic, module, className, signature, value});
+            ++_size;
+        }
+
+        const V* find(
+            std::uint64_t hash, const char* module, const char* className, bool isStatic, const char* signature) const
+        {
+            if (_slots.empty())
+            {
+                return nullptr;
+            }
+
+            const std::size_t mask = _slots.size() - 1u;
+            for (std::size_t i = static_cast<std::size_t>(hash) & mask;; i = (i + 1u) & mask)
+            {
+                const Slot& slot = _slots[i];
+                if (!slot.used)
+                {
+                    return nullptr;
+                }
+                if (slot.hash == hash && slot.isStatic == isStatic && slot.signature == signature &&
+                    slot.className == className && slot.module == module)
+                {
+                    return &slot.value;
+                }
+            }
+        }
+
+        V* find(std::uint64_t hash, const char* module, const char* className, bool isStatic, const char* signature)
+        {
+            return const_cast<V*>(static_cast<const SignatureMap&>(*this).find(hash, module, className, isStatic,
+                                                                               signature));
+        }
+
+        std::size_t size() const
+        {
+            return _size;
+        }
+
+        // calls f(module, className, isStatic, signature, value) for each binding
+        template <typename F>
+        void forEach(F f) const
+        {
+            for (const Slot& slot : _slots)
+            {
+                if (slot.used)
+                {
+                    f(slot.module, slot.className, slot.isStatic, slot.signature, slot.value);
+                }
+            }
+        }
+
+    private:
+        struct Slot
+        {
+            std::uint64_t hash;
+            bool          used;
+            bool          isStatic;
+            std::string   module;
+            std::string   className;
+            std::string   signature;
+            V             value;
+        };
+
+        void place(Slot slot)
+        {
+            const std::size_t mask = _slots.size() - 1u;
+            std::size_t       i    = static_cast<std::size_t>(slot.hash) & mask;
+            while (_slots[i].used)
+            {
+                i = (i + 1u) & mask;
+            }
+            _slots[i] = std::move(slot);
+        }
+
+        void grow()
+        {
+            std::vector<Slot> old(_slots.empty() ? 16u : 2u * _slots.size());
+            old.swap(_slots);
+            for (Slot& slot : old)
+            {
+                if (slot.used)
+                {
+                    place(std::move(slot));
+                }
+            }
+        }
+
+        std::vector<Slot> _slots {};
+        std::size_t       _size {0u};
+    };
+
+    // lambdas and other function objects
     template <typename F>
-    struct FunctionTraits;
+    struct FunctionTraits : public FunctionTraits<decltype(&F::operator())>
+    {
+    };
 
     template <typename R, typename... Args>
     struct FunctionTraits<R(Args...)>
@@ -272,9 +741,7 @@ namespace detail
     {
         static T get(WrenVM* vm, int slot)
         {
-            ForeignObject* obj = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot));
-            assert(obj->typeId() == getTypeId<T>());
-            return *static_cast<T*>(obj->objectPtr());
+            return *objectAs<const T>(static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot)));
         }
 
         static void set(WrenVM* vm, int slot, T t)
@@ -288,9 +755,7 @@ namespace detail
     {
         static T& get(WrenVM* vm, int slot)
         {
-            ForeignObject* obj = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot));
-            assert(obj->typeId() == getTypeId<T>() && "Different type expected");
-            return *static_cast<T*>(obj->objectPtr());
+            return *objectAs<T>(static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot)));
         }
 
         static void set(WrenVM* vm, int slot, T& t)
@@ -304,14 +769,12 @@ namespace detail
     {
         static const T& get(WrenVM* vm, int slot)
         {
-            ForeignObject* obj = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot));
-            assert(obj->typeId() == getTypeId<T>() && "Different type expected");
-            return *static_cast<T*>(obj->objectPtr());
+            return *objectAs<const T>(static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot)));
         }
 
-        static void set(WrenVM* vm, int /*slot*/, const T& t)
+        static void set(WrenVM* vm, int slot, const T& t)
         {
-            ForeignObjectPtr<T>::setInSlot(vm, 0, const_cast<T*>(&t));
+            ForeignObjectPtr<const T>::setInSlot(vm, slot, &t);
         }
     };
 
@@ -320,9 +783,7 @@ namespace detail
     {
         static T* get(WrenVM* vm, int slot)
         {
-            ForeignObject* obj = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot));
-            assert(obj->typeId() == getTypeId<T>() && "Different type expected");
-            return static_cast<T*>(obj->objectPtr());
+            return objectAs<T>(static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot)));
         }
 
         static void set(WrenVM* vm, int slot, T* t)
@@ -336,14 +797,12 @@ namespace detail
     {
         static const T* get(WrenVM* vm, int slot)
         {
-            ForeignObject* obj = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot));
-            assert(obj->typeId() == getTypeId<T>() && "Different type expected");
-            return static_cast<const T*>(obj->objectPtr());
+            return objectAs<const T>(static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot)));
         }
 
         static void set(WrenVM* vm, int slot, const T* t)
         {
-            ForeignObjectPtr<T>::setInSlot(vm, slot, const_cast<T*>(t));
+            ForeignObjectPtr<const T>::setInSlot(vm, slot, t);
         }
     };
 
@@ -389,12 +848,24 @@ namespace detail
         }
     };
 
+    /// Converting a negative, NaN or too large number to an unsigned type is undefined, so
+    /// those are rejected with std::out_of_range, which aborts the calling fiber.
+    template <typename U>
+    U toUnsigned(double value)
+    {
+        if (!(value >= 0.0 && value < double(std::numeric_limits<U>::max()) + 1.0))
+        {
+            throw std::out_of_range("expected a non-negative number");
+        }
+        return U(value);
+    }
+
     template <>
     struct WrenSlotAPI<unsigned>
     {
         static unsigned get(WrenVM* vm, int slot)
         {
-            return unsigned(wrenGetSlotDouble(vm, slot));
+            return toUnsigned<unsigned>(wrenGetSlotDouble(vm, slot));
         }
 
         static void set(WrenVM* vm, int slot, unsigned val)
@@ -422,7 +893,7 @@ namespace detail
     {
         static size_t get(WrenVM* vm, int slot)
         {
-            return size_t(wrenGetSlotDouble(vm, slot));
+            return toUnsigned<size_t>(wrenGetSlotDouble(vm, slot));
         }
 
         static void set(WrenVM* vm, int slot, size_t val)
@@ -501,6 +972,43 @@ namespace detail
         }
     };
 
+    // The slot must hold a handle, not a value or pointer of T, or the call aborts the fiber.
+    template <typename T>
+    struct WrenSlotAPI<Handle<T> >
+    {
+        static Handle<T> get(WrenVM* vm, int slot)
+        {
+            if (wrenGetSlotType(vm, slot) == WREN_TYPE_FOREIGN)
+            {
+                ForeignObject* obj = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot));
+                if (obj->isHandle() && obj->typeId() == getTypeId<T>())
+                {
+                    return static_cast<ForeignObjectHandle<T>*>(obj)->handle();
+                }
+            }
+            throw std::runtime_error("expected a handle");
+        }
+
+        static void set(WrenVM* vm, int slot, Handle<T> handle)
+        {
+            ForeignObjectHandle<T>::setInSlot(vm, slot, handle);
+        }
+    };
+
+    template <typename R, typename... Args>
+    struct WrenSlotAPI<Function<R(Args...)> >
+    {
+        static Function<R(Args...)> get(WrenVM* vm, int slot)
+        {
+            return Function<R(Args...)>(vm, wrenGetSlotHandle(vm, slot));
+        }
+
+        static void set(WrenVM* vm, int slot, const Function<R(Args...)>& function)
+        {
+            wrenSetSlotHandle(vm, slot, function.handle());
+        }
+    };
+
     struct ExpandType
     {
         template <typename... T>
@@ -515,6 +1023,7 @@ namespace detail
     template <typename... Args, std::size_t... index>
     void passArgumentsToWren(WrenVM* vm, const std::tuple<Args...>& tuple, std::index_sequence<index...>)
     {
+        (void)vm;  // unused when there are no arguments
         using Traits = ParameterPackTraits<Args...>;
         ExpandType{0, (WrenSlotAPI<typename Traits::template ParameterType<index> >::set(vm, index + 1,
                                                                                          std::get<index>(tuple)),
@@ -524,6 +1033,7 @@ namespace detail
     template <typename Function, std::size_t... index>
     decltype(auto) invokeHelper(WrenVM* vm, Function&& f, std::index_sequence<index...>)
     {
+        (void)vm;  // unused when there are no arguments
         using Traits = FunctionTraits<std::remove_reference_t<decltype(f)> >;
         return f(WrenSlotAPI<typename Traits::template ArgumentType<index> >::get(vm, index + 1)...);
     }
@@ -535,38 +1045,26 @@ namespace detail
         return invokeHelper<Function>(vm, std::forward<Function>(f), std::make_index_sequence<Arity>{});
     }
 
-    template <typename R, typename C, typename... Args, std::size_t... index>
-    decltype(auto) invokeHelper(WrenVM* vm, R (C::*f)(Args...), std::index_sequence<index...>)
-    {
-        using Traits              = FunctionTraits<decltype(f)>;
-        ForeignObject* objWrapper = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, 0));
-        C*             obj        = static_cast<C*>(objWrapper->objectPtr());
-        return (obj->*f)(WrenSlotAPI<typename Traits::template ArgumentType<index> >::get(vm, index + 1)...);
-    }
-
-    // const variant
-    template <typename R, typename C, typename... Args, std::size_t... index>
-    decltype(auto) invokeHelper(WrenVM* vm, R (C::*f)(Args...) const, std::index_sequence<index...>)
+    // the receiver of a method of C; shared by all methods bound on C
+    template <typename C>
+    void* methodReceiver(ForeignObject* objWrapper)
     {
-        using Traits              = FunctionTraits<decltype(f)>;
-        ForeignObject* objWrapper = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, 0));
-        const C*       obj        = static_cast<const C*>(objWrapper->objectPtr());
-        return (obj->*f)(WrenSlotAPI<typename Traits::template ArgumentType<index> >::get(vm, index + 1)...);
+        return const_cast<std::remove_const_t<C>*>(objectAs<C>(objWrapper));
     }
 
-    template <typename R, typename C, typename... Args>
-    decltype(auto) invokeWithWrenArguments(WrenVM* vm, R (C::*f)(Args...))
+    // Calls a method through invoke, a stub which knows the method and its class, with the
+    // arguments in slots 1..N. The result, if any, goes in slot 0.
+    template <typename... Args, std::size_t... index>
+    void invokeMethod(WrenVM* vm, void* obj, void (*invoke)(void*, Args...), std::index_sequence<index...>)
     {
-        constexpr auto Arity = FunctionTraits<decltype(f)>::Arity;
-        return invokeHelper(vm, f, std::make_index_sequence<Arity>{});
+        (void)vm;  // unused when the method takes no arguments
+        invoke(obj, WrenSlotAPI<Args>::get(vm, index + 1)...);
     }
 
-    // const variant
-    template <typename R, typename C, typename... Args>
-    decltype(auto) invokeWithWrenArguments(WrenVM* vm, R (C::*f)(Args...) const)
+    template <typename R, typename... Args, std::size_t... index>
+    void invokeMethod(WrenVM* vm, void* obj, R (*invoke)(void*, Args...), std::index_sequence<index...>)
     {
-        constexpr auto Arity = FunctionTraits<decltype(f)>::Arity;
-        return invokeHelper(vm, f, std::make_index_sequence<Arity>{});
+        WrenSlotAPI<R>::set(vm, 0, invoke(obj, WrenSlotAPI<Args>::get(vm, index + 1)...));
     }
 
     /// invokes plain invokeWithWrenArguments if true
@@ -580,12 +1078,6 @@ namespace detail
         {
             invokeWithWrenArguments(vm, std::forward<Function>(f));
         }
-
-        template <typename R, typename C, typename... Args>
-        static void invoke(WrenVM* vm, R (C::*f)(Args...))
-        {
-            invokeWithWrenArguments(vm, std::forward<R (C::*)(Args...)>(f));
-        }
     };
 
     template <>
@@ -597,105 +1089,375 @@ namespace detail
             using ReturnType = typename FunctionTraits<std::remove_reference_t<decltype(f)> >::ReturnType;
             WrenSlotAPI<ReturnType>::set(vm, 0, invokeWithWrenArguments(vm, std::forward<Function>(f)));
         }
+    };
 
-        template <typename R, typename C, typename... Args>
-        static void invoke(WrenVM* vm, R (C::*f)(Args...))
-        {
-            WrenSlotAPI<R>::set(vm, 0, invokeWithWrenArguments(vm, f));
-        }
+    /// aborts the current fiber with the given message, which surfaces as a Wren runtime error
+    inline void abortFiber(WrenVM* vm, const char* message)
+    {
+        wrenEnsureSlots(vm, 1);
+        wrenSetSlotString(vm, 0, message);
+        wrenAbortFiber(vm, 0);
+    }
 
-        template <typename R, typename C, typename... Args>
-        static void invoke(WrenVM* vm, R (C::*f)(Args...) const)
-        {
-            WrenSlotAPI<R>::set(vm, 0, invokeWithWrenArguments(vm, f));
-        }
-    };
+#if defined(WRENPP_PROFILE)
+    struct CallProfile;
 
-    template <typename Signature, Signature>
-    struct ForeignMethodWrapper;
+    /// the VM's profile, or nullptr if profiling is off for the VM
+    CallProfile* callProfile(WrenVM* vm);
+    void         recordCall(CallProfile* profile, WrenForeignMethodFn function, std::chrono::nanoseconds duration);
 
-    // free function variant
-    template <typename R, typename... Args, R (*f)(Args...)>
-    struct ForeignMethodWrapper<R (*)(Args...), f>
+    /// Times a call to a bound function, if profiling is on for the VM.
+    class ProfileScope
     {
-        static void call(WrenVM* vm)
+    public:
+        ProfileScope(WrenVM* vm, WrenForeignMethodFn function)
+            : _profile(callProfile(vm))
+            , _function(function)
         {
-            InvokeWithoutReturningIf<std::is_void<R>::value>::invoke(vm, f);
+            if (_profile)
+            {
+                _start = std::chrono::steady_clock::now();
+            }
         }
-    };
 
-    // method variant
-    template <typename R, typename C, typename... Args, R (C::*m)(Args...)>
-    struct ForeignMethodWrapper<R (C::*)(Args...), m>
-    {
-        static void call(WrenVM* vm)
+        ~ProfileScope()
         {
-            InvokeWithoutReturningIf<std::is_void<R>::value>::invoke(vm, m);
+            if (_profile)
+            {
+                recordCall(_profile, _function, std::chrono::steady_clock::now() - _start);
+            }
         }
-    };
 
-    // const method variant
-    template <typename R, typename C, typename... Args, R (C::*m)(Args...) const>
-    struct ForeignMethodWrapper<R (C::*)(Args...) const, m>
+    private:
+        CallProfile*                          _profile;
+        WrenForeignMethodFn                   _function;
+        std::chrono::steady_clock::time_point _start {};
+    };
+#else
+    class ProfileScope
     {
-        static void call(WrenVM* vm)
-        {
-            InvokeWithoutReturningIf<std::is_void<R>::value>::invoke(vm, m);
-        }
+    public:
+        ProfileScope(WrenVM*, WrenForeignMethodFn) {}
     };
+#endif
 
-    /// FOREIGN PROPERTY
+    /// whether Tracer is recording
+    extern std::atomic<bool> tracing;
 
-    // See this link for more about writing a metaprogramming type is_sharable<t>:
-    // http://anthony.noided.media/blog/programming/c++/ruby/2016/05/12/mruby-cpp-and-template-magic.html
+    /// records a begin ('B') or end ('E') event on the calling thread
+    void traceEvent(const char* name, char phase);
 
-    template <bool isClass>
-    struct SetFieldInSlot
+    /// the name of a span of a function bound in the VM, which is looked up on the function's
+    /// first span in the VM
+    const char* functionTraceName(WrenVM* vm, WrenForeignMethodFn function);
+
+    /// returns a copy of the string which lives until the process exits, one per distinct string
+    const char* internName(const std::string& name);
+
+    /// What a Method calls. Methods of a VM with the same target share one call site, which the
+    /// VM's handle cache keeps while a Method uses it.
+    struct CallSite
     {
-        template <typename T>
-        static void set(WrenVM* vm, int slot, T& obj)
-        {
-            ForeignObjectPtr<T>::setInSlot(vm, slot, &obj);
-        }
+        std::string module;
+        std::string variable;
+        std::string signature;
+        std::string         name;              // module.variable.signature
+        mutable const char* traced {nullptr};  // the interned name, set on the site's first span
     };
 
-    template <>
-    struct SetFieldInSlot<false>
+    /// the name of a span of a call through a call site
+    const char* callSiteTraceName(const CallSite& site);
+
+    /// records a call whose arguments are in slots 1 to arity, if the VM is recording
+    void recordCall(WrenVM* vm, const CallSite* site, int arity);
+
+    /// the VM's cached call(_,...) handle for closures taking arity arguments
+    WrenHandle* closureCallHandle(WrenVM* vm, std::size_t arity);
+    /// releases a handle made by the VM's handle cache, or any other handle
+    void releaseHandle(WrenVM* vm, WrenHandle* handle);
+
+    /// The handles a Function calls through, shared between its copies.
+    struct FunctionHandles
     {
-        template <typename T>
-        static void set(WrenVM* vm, int slot, T value)
+        FunctionHandles(WrenVM* vm, WrenHandle* closure, std::size_t arity)
+            : vm(vm)
+            , closure(closure)
+            , call(closureCallHandle(vm, arity))
         {
-            WrenSlotAPI<T>::set(vm, slot, value);
         }
+        FunctionHandles(const FunctionHandles&) = delete;
+        FunctionHandles& operator=(const FunctionHandles&) = delete;
+        ~FunctionHandles()
+        {
+            releaseHandle(vm, call);
+            releaseHandle(vm, closure);
+        }
+
+        WrenVM*     vm;
+        WrenHandle* closure;
+        WrenHandle* call;
     };
 
-    template <typename T, typename U, U T::*Field>
-    void propertyGetter(WrenVM* vm)
+    /// lets values of a trivially copyable type be recorded as bytes, and restored on replay
+    void registerRecordableType(std::uint32_t typeId, std::size_t size,
+                                void (*restore)(WrenVM* vm, int slot, const void* bytes));
+
+    template <typename T>
+    void restoreForeignValue(WrenVM* vm, int slot, const void* bytes);
+
+    template <typename T>
+    void registerRecordable(std::true_type)
+    {
+        registerRecordableType(getTypeId<T>(), sizeof(T), &restoreForeignValue<T>);
+    }
+
+    template <typename T>
+    void registerRecordable(std::false_type)
+    {
+    }
+
+    /// Records a span, if Tracer is recording when the span begins.
+    class TraceScope
+    {
+    public:
+        explicit TraceScope(const char* name)
+            : _active(tracing.load(std::memory_order_relaxed))
+            , _name(name)
+        {
+            if (_active)
+            {
+                traceEvent(_name, 'B');
+            }
+        }
+
+        TraceScope(WrenVM* vm, WrenForeignMethodFn function)
+            : _active(tracing.load(std::memory_order_relaxed))
+            , _name(_active ? functionTraceName(vm, function) : nullptr)
+        {
+            if (_active)
+            {
+                traceEvent(_name, 'B');
+            }
+        }
+
+        TraceScope(const CallSite* site, const char* name)
+            : _active(tracing.load(std::memory_order_relaxed))
+            , _name(_active && site ? callSiteTraceName(*site) : name)
+        {
+            if (_active)
+            {
+                traceEvent(_name, 'B');
+            }
+        }
+
+        ~TraceScope()
+        {
+            if (_active)
+            {
+                traceEvent(_name, 'E');
+            }
+        }
+
+    private:
+        bool        _active;
+        const char* _name;
+    };
+
+    // Exceptions thrown by bound functions must not unwind through the Wren interpreter, so
+    // they are turned into runtime errors in the calling fiber instead.
+
+    // Marshalling the arguments and the result is done by functions shared by all bound
+    // functions with the same signature. Only the thunks which pass the function along are
+    // generated per bound function, and they are a few instructions each.
+
+    template <typename R, typename... Args>
+    WRENPP_NOINLINE void callFunction(WrenVM* vm, R (*f)(Args...), WrenForeignMethodFn self)
+    {
+        ProfileScope profile(vm, self);
+        TraceScope   trace(vm, self);
+        try
+        {
+            InvokeWithoutReturningIf<std::is_void<R>::value>::invoke(vm, f);
+        }
+        catch (const std::exception& e)
+        {
+            abortFiber(vm, e.what());
+        }
+    }
+
+    // Methods are shared by return and argument types alone: the thunk passes the receiver
+    // unwrapper of its class, and a stub which calls the method on the receiver.
+    // trackChanges marks the receiver dirty after the call.
+    template <typename R, typename... Args>
+    WRENPP_NOINLINE void callMethod(WrenVM* vm, void* (*receiver)(ForeignObject*), R (*invoke)(void*, Args...),
+                                    bool trackChanges, WrenForeignMethodFn self)
+    {
+        ProfileScope profile(vm, self);
+        TraceScope   trace(vm, self);
+        try
+        {
+            // fetched up front, since the result replaces the receiver in slot 0
+            ForeignObject* objWrapper = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, 0));
+            invokeMethod(vm, receiver(objWrapper), invoke, std::index_sequence_for<Args...>{});
+            if (trackChanges)
+            {
+                objWrapper->markDirty();
+            }
+        }
+        catch (const std::exception& e)
+        {
+            abortFiber(vm, e.what());
+        }
+    }
+
+    template <typename Signature, Signature>
+    struct ForeignMethodWrapper;
+
+    // free function variant
+    template <typename R, typename... Args, R (*f)(Args...)>
+    struct ForeignMethodWrapper<R (*)(Args...), f>
+    {
+        static void call(WrenVM* vm)
+        {
+            callFunction(vm, f, &call);
+        }
+    };
+
+    // method variant
+    template <typename R, typename C, typename... Args, R (C::*m)(Args...)>
+    struct ForeignMethodWrapper<R (C::*)(Args...), m>
+    {
+        static R invoke(void* obj, Args... args)
+        {
+            return (static_cast<C*>(obj)->*m)(std::forward<Args>(args)...);
+        }
+
+        static void call(WrenVM* vm)
+        {
+            callMethod<R, Args...>(vm, &methodReceiver<C>, &invoke, false, &call);
+        }
+    };
+
+    // const method variant
+    template <typename R, typename C, typename... Args, R (C::*m)(Args...) const>
+    struct ForeignMethodWrapper<R (C::*)(Args...) const, m>
+    {
+        static R invoke(void* obj, Args... args)
+        {
+            return (static_cast<const C*>(obj)->*m)(std::forward<Args>(args)...);
+        }
+
+        static void call(WrenVM* vm)
+        {
+            callMethod<R, Args...>(vm, &methodReceiver<const C>, &invoke, false, &call);
+        }
+    };
+
+    // Marks the receiver dirty after calling a non-const method. Other functions can't change
+    // their receiver, and aren't tracked.
+    template <typename F, F f>
+    struct TrackedMethodWrapper : public ForeignMethodWrapper<F, f>
+    {
+    };
+
+    template <typename R, typename C, typename... Args, R (C::*m)(Args...)>
+    struct TrackedMethodWrapper<R (C::*)(Args...), m>
+    {
+        static void call(WrenVM* vm)
+        {
+            callMethod<R, Args...>(vm, &methodReceiver<C>, &ForeignMethodWrapper<R (C::*)(Args...), m>::invoke, true,
+                                   &call);
+        }
+    };
+
+    /// FOREIGN PROPERTY
+
+    // See this link for more about writing a metaprogramming type is_sharable<t>:
+    // http://anthony.noided.media/blog/programming/c++/ruby/2016/05/12/mruby-cpp-and-template-magic.html
+
+    template <bool isClass>
+    struct SetFieldInSlot
+    {
+        template <typename T>
+        static void set(WrenVM* vm, int slot, T& obj)
+        {
+            ForeignObjectPtr<T>::setInSlot(vm, slot, &obj);
+        }
+    };
+
+    template <>
+    struct SetFieldInSlot<false>
+    {
+        template <typename T>
+        static void set(WrenVM* vm, int slot, T value)
+        {
+            WrenSlotAPI<T>::set(vm, slot, value);
+        }
+    };
+
+    // shared by all fields of type U in T, like callMethod
+    template <typename T, typename U>
+    WRENPP_NOINLINE void getField(WrenVM* vm, U T::*field, WrenForeignMethodFn self)
     {
+        ProfileScope   profile(vm, self);
+        TraceScope     trace(vm, self);
         ForeignObject* objWrapper = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, 0));
-        T*             obj        = static_cast<T*>(objWrapper->objectPtr());
-        SetFieldInSlot<std::is_class<U>::value>::set(vm, 0, obj->*Field);
+        try
+        {
+            // fields of read-only objects are read-only too
+            if (objWrapper->readOnly())
+            {
+                const T* obj = objectAs<const T>(objWrapper);
+                SetFieldInSlot<std::is_class<U>::value>::set(vm, 0, obj->*field);
+            }
+            else
+            {
+                T* obj = objectAs<T>(objWrapper);
+                SetFieldInSlot<std::is_class<U>::value>::set(vm, 0, obj->*field);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            abortFiber(vm, e.what());
+        }
     }
 
-    template <typename T, typename U, U T::*Field>
-    void propertySetter(WrenVM* vm)
+    template <typename T, typename U>
+    WRENPP_NOINLINE void setField(WrenVM* vm, U T::*field, bool trackChanges, WrenForeignMethodFn self)
     {
+        ProfileScope   profile(vm, self);
+        TraceScope     trace(vm, self);
         ForeignObject* objWrapper = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, 0));
-        T*             obj        = static_cast<T*>(objWrapper->objectPtr());
-        obj->*Field               = WrenSlotAPI<U>::get(vm, 1);
+        try
+        {
+            T* obj      = objectAs<T>(objWrapper);
+            obj->*field = WrenSlotAPI<U>::get(vm, 1);
+        }
+        catch (const std::exception& e)
+        {
+            abortFiber(vm, e.what());
+            return;
+        }
+        if (trackChanges)
+        {
+            objWrapper->markDirty();
+        }
     }
 
-    /// FOREIGN CLASS
+    template <typename T, typename U, U T::*Field>
+    void propertyGetter(WrenVM* vm)
+    {
+        getField(vm, Field, &propertyGetter<T, U, Field>);
+    }
 
-    // given a Wren class signature, this returns a unique value
-    inline std::size_t hashClassSignature(const char* module, const char* className)
+    template <typename T, typename U, U T::*Field, bool trackChanges>
+    void propertySetter(WrenVM* vm)
     {
-        std::hash<std::string> hash;
-        std::string            qualified(module);
-        qualified += className;
-        return hash(qualified);
+        setField(vm, Field, trackChanges, &propertySetter<T, U, Field, trackChanges>);
     }
 
+    /// FOREIGN CLASS
+
     template <typename T, typename... Args, std::size_t... index>
     void construct(WrenVM* vm, void* memory, std::index_sequence<index...>)
     {
@@ -704,13 +1466,26 @@ namespace detail
         constexpr std::size_t arity = sizeof...(Args);
         wrenEnsureSlots(vm, arity);
         new (obj->objectPtr()) T{WrenSlotAPI<typename Traits::template ParameterType<index> >::get(vm, index + 1)...};
+        obj->track(vm, sizeof(ForeignObjectValue<T>));
     }
 
     template <typename T, typename... Args>
     void allocate(WrenVM* vm)
     {
-        void* memory = wrenSetSlotNewForeign(vm, 0, 0, sizeof(ForeignObjectValue<T>));
-        construct<T, Args...>(vm, memory, std::make_index_sequence<ParameterPackTraits<Args...>::size>{});
+        ProfileScope profile(vm, &allocate<T, Args...>);
+        TraceScope   trace(vm, &allocate<T, Args...>);
+        void*        memory = wrenSetSlotNewForeign(vm, 0, 0, sizeof(ForeignObjectValue<T>));
+        try
+        {
+            construct<T, Args...>(vm, memory, std::make_index_sequence<ParameterPackTraits<Args...>::size>{});
+        }
+        catch (const std::exception& e)
+        {
+            // T was never constructed, so leave something behind which is safe to finalize
+            static_assert(sizeof(ForeignObjectPtr<T>) <= sizeof(ForeignObjectValue<T>), "");
+            new (memory) ForeignObjectPtr<T>{nullptr};
+            abortFiber(vm, e.what());
+        }
     }
 
     template <typename T>
@@ -721,9 +1496,67 @@ namespace detail
         objWrapper->~ForeignObject();
     }
 
-    void registerFunction(WrenVM* vm, const std::string& mod, const std::string& clss, bool isStatic, std::string sig,
-                          WrenForeignMethodFn function);
-    void registerClass(WrenVM* vm, const std::string& mod, std::string clss, WrenForeignClassMethods methods);
+    /// Maps the signatures of foreign methods and classes to their implementations, and records
+    /// them so that the Wren declarations of bound modules can be generated.
+    class BindingTable;
+
+    void registerFunction(BindingTable& table, const std::string& mod, const std::string& clss, bool isStatic,
+                          Signature sig, WrenForeignMethodFn function);
+    /// the constructor is a signature such as "new(_,_)", or empty if the class has none
+    void registerClass(BindingTable& table, const std::string& mod, std::string clss, std::string constructor,
+                       WrenForeignClassMethods methods);
+    /// true if a foreign class of that name was registered in the table
+    bool hasClass(const BindingTable& table, const std::string& mod, const std::string& clss);
+    /// generate the module's declarations instead of loading its source
+    void generateDeclarations(BindingTable& table, const std::string& mod);
+    /// Binds the instance methods of the base class on the derived class too. The base is looked
+    /// for in the table, and with a VM, in its deferred modules and binding sets; if it isn't
+    /// found, throws std::logic_error.
+    void inheritMethods(WrenVM*            vm,
+                        BindingTable&      table,
+                        const std::string& baseModule,
+                        const std::string& baseClass,
+                        const std::string& mod,
+                        const std::string& clss);
+
+    using FunctorInvoker = void (*)(void* functor, WrenVM* vm);
+
+    /// Binds a functor, owned by the table, which is called through the invoker. Each VM which
+    /// binds the functor gives it one of its WRENPP_MAX_FUNCTORS thunks.
+    void registerFunctor(BindingTable& table, const std::string& mod, const std::string& clss, bool isStatic,
+                         Signature sig, std::shared_ptr<void> functor, FunctorInvoker invoke);
+
+    template <typename F>
+    void invokeFunctor(void* functor, WrenVM* vm)
+    {
+        using R = typename FunctionTraits<F>::ReturnType;
+        try
+        {
+            InvokeWithoutReturningIf<std::is_void<R>::value>::invoke(vm, *static_cast<F*>(functor));
+        }
+        catch (const std::exception& e)
+        {
+            abortFiber(vm, e.what());
+        }
+    }
+
+    /// the VM's own bindings
+    BindingTable& boundTable(WrenVM* vm);
+
+    /// the bindings of published objects, which every VM sees
+    BindingTable& publishedTable();
+
+    // store the name and module of a bound type, if not already done
+    template <typename T>
+    void storeTypeNames(const std::string& mod, const std::string& className)
+    {
+        if (classNameStorage().size() == getTypeId<T>())
+        {
+            assert(classNameStorage().size() == moduleNameStorage().size());
+            bindTypeToModuleName<T>(mod);
+            bindTypeToClassName<T>(className);
+        }
+    }
 
     inline bool fileExists(const std::string& file)
     {
@@ -746,6 +1579,27 @@ namespace detail
         buffer << fin.rdbuf() << '\0';
         return buffer.str();
     }
+
+    /// NUMERIC KERNELS
+
+    // These are vectorised with AVX or SSE when the compiler targets them, and fall back to
+    // scalar loops otherwise. The binary operations act in place on dst.
+    void addKernel(float* dst, const float* src, std::size_t count);
+    void addKernel(double* dst, const double* src, std::size_t count);
+    void mulKernel(float* dst, const float* src, std::size_t count);
+    void mulKernel(double* dst, const double* src, std::size_t count);
+    void fmaKernel(float* dst, const float* a, const float* b, std::size_t count);
+    void fmaKernel(double* dst, const double* a, const double* b, std::size_t count);
+    void scaleKernel(float* dst, float factor, std::size_t count);
+    void scaleKernel(double* dst, double factor, std::size_t count);
+    float  dotKernel(const float* a, const float* b, std::size_t count);
+    double dotKernel(const double* a, const double* b, std::size_t count);
+    float  sumKernel(const float* src, std::size_t count);
+    double sumKernel(const double* src, std::size_t count);
+    float  minKernel(const float* src, std::size_t count);
+    double minKernel(const double* src, std::size_t count);
+    float  maxKernel(const float* src, std::size_t count);
+    double maxKernel(const double* src, std::size_t count);
 }
 
 class VM;
@@ -756,8 +1610,11 @@ class Method;
 class Value
 {
 public:
-    Value()                   = default;
-    Value(const Value& value) = default;
+    Value() = default;
+    Value(const Value& value);
+    Value(Value&& value);
+    Value& operator=(const Value& rhs);
+    Value& operator=(Value&& rhs);
     ~Value();
 
     Value(bool);
@@ -789,7 +1646,7 @@ extern Value null;
 class Method
 {
 public:
-    Method(VM* vm, WrenHandle* variable, WrenHandle* method);
+    Method(VM* vm, WrenHandle* variable, WrenHandle* method, const detail::CallSite* site = nullptr);
     Method()              = default;
     Method(const Method&) = delete;
     Method(Method&&);
@@ -804,12 +1661,137 @@ public:
     Value operator()(Args... args) const;
 
 private:
-    mutable VM*         _vm{nullptr};
-    mutable WrenHandle* _method{nullptr};
-    mutable WrenHandle* _variable{nullptr};
+    void release();
+
+    mutable VM*             _vm{nullptr};
+    mutable WrenHandle*     _method{nullptr};
+    mutable WrenHandle*     _variable{nullptr};
+    const detail::CallSite* _site{nullptr};  // for traces and recordings
+};
+
+/// A method signature which isn't tied to a receiver, so that the same method can be called on
+/// any number of objects without making handles for each of them. Like Method, this stores a
+/// reference to the owning VM instance.
+class CallSignature
+{
+public:
+    CallSignature(VM* vm, WrenHandle* method, const detail::CallSite* site = nullptr);
+    CallSignature()                     = default;
+    CallSignature(const CallSignature&) = delete;
+    CallSignature(CallSignature&&);
+    CallSignature& operator=(const CallSignature&) = delete;
+    CallSignature& operator                        =(CallSignature&&);
+    ~CallSignature();
+    explicit operator bool() const;
+
+    /// The receiver is either a WrenHandle* or a pointer to an instance of a bound class.
+    template <typename Receiver, typename... Args>
+    Value operator()(Receiver receiver, Args... args) const;
+
+    /// Calls the method on each receiver in the range with the same arguments, and returns
+    /// how many of the calls succeeded.
+    template <typename Iterator, typename... Args>
+    std::size_t forEach(Iterator first, Iterator last, Args... args) const;
+
+private:
+    void release();
+
+    VM*                     _vm{nullptr};
+    WrenHandle*             _method{nullptr};
+    const detail::CallSite* _site{nullptr};  // for traces
+};
+
+/// A Wren closure, such as an Fn, which can be called from C++ like a function. Foreign
+/// functions can take one as an argument. The closure's handle and the call(_,...) handle for its
+/// arity are made once, and shared between copies, so calling allocates nothing beyond what the
+/// closure does in Wren.
+/// Note that Wren doesn't support calling back into the VM from within a foreign method, so
+/// store the Function and call it after the foreign method has returned. Like Method, the
+/// Function must not outlive the VM.
+template <typename R, typename... Args>
+class Function<R(Args...)>
+{
+public:
+    Function() = default;
+    /// takes ownership of the closure handle
+    Function(WrenVM* vm, WrenHandle* closure)
+        : _handles(std::make_shared<detail::FunctionHandles>(vm, closure, sizeof...(Args)))
+    {
+    }
+
+    explicit operator bool() const
+    {
+        return _handles != nullptr;
+    }
+
+    WrenHandle* handle() const
+    {
+        return _handles ? _handles->closure : nullptr;
+    }
+
+    /// Returns a default constructed R if the closure aborts its fiber.
+    R operator()(Args... args) const;
+
+private:
+    std::shared_ptr<detail::FunctionHandles> _handles{};
 };
 
 class ModuleContext;
+class MappedFile;
+class ByteBuffer;
+class StringBuilder;
+class Channel;
+class JsonDocument;
+class JsonWriter;
+template <typename T>
+class NumericBuffer;
+
+/// A method signature, such as "norm()" or "[_]=(_)", and its hash. A Signature refers to its
+/// text rather than owning it. The hash is computed where the Signature is constructed, so
+/// signatures declared constexpr are hashed at compile time, and binding them only combines
+/// their hash with the class's:
+///
+///     constexpr wrenpp::Signature norm{"norm()"};
+///     vm.beginModule("vector").bindClass<Vec3>("Vec3").bindMethod<decltype(&Vec3::norm), &Vec3::norm>(false, norm);
+///
+/// Other signatures are hashed when they are bound.
+class Signature
+{
+public:
+    constexpr Signature(const char* text)
+        : _text(text)
+        , _hash(detail::hashString(text))
+    {
+    }
+
+    Signature(const std::string& text)
+        : _text(text.c_str())
+        , _hash(detail::hashString(_text))
+    {
+    }
+
+    /// for signatures hashed ahead of time, such as by generated code. The hash must be the
+    /// detail::hashString of the text, or lookups won't find the binding.
+    constexpr Signature(const char* text, std::uint64_t hash)
+        : _text(text)
+        , _hash(hash)
+    {
+    }
+
+    constexpr const char* text() const
+    {
+        return _text;
+    }
+
+    constexpr std::uint64_t hash() const
+    {
+        return _hash;
+    }
+
+private:
+    const char*   _text;
+    std::uint64_t _hash;
+};
 
 class ClassContext
 {
@@ -819,8 +1801,13 @@ public:
     virtual ~ClassContext() = default;
 
     template <typename F, F f>
-    ClassContext& bindFunction(bool isStatic, std::string signature);
-    ClassContext& bindCFunction(bool isStatic, std::string signature, WrenForeignMethodFn function);
+    ClassContext& bindFunction(bool isStatic, Signature signature);
+    ClassContext& bindCFunction(bool isStatic, Signature signature, WrenForeignMethodFn function);
+    /// Binds a lambda or other function object, which may carry state. It lives as long as the
+    /// VM or BindingSet it is bound to, and is called through a thunk of its own rather than
+    /// through a std::function.
+    template <typename F>
+    ClassContext& bindFunctor(bool isStatic, Signature signature, F functor);
 
     ModuleContext& endClass();
 
@@ -840,13 +1827,25 @@ public:
 
     virtual ~RegisteredClassContext() = default;
 
+    /// With trackChanges, calling a non-const method adds the receiver to the VM's dirty set
+    /// for T, which VM::drainDirty visits.
     template <typename F, F f>
-    RegisteredClassContext& bindMethod(bool isStatic, std::string signature);
+    RegisteredClassContext& bindMethod(bool isStatic, Signature signature, bool trackChanges = false);
     template <typename U, U T::*Field>
-    RegisteredClassContext& bindGetter(std::string signature);
+    RegisteredClassContext& bindGetter(Signature signature);
+    /// With trackChanges, setting the property adds the object to the VM's dirty set for T.
     template <typename U, U T::*Field>
-    RegisteredClassContext& bindSetter(std::string signature);
-    RegisteredClassContext& bindCFunction(bool isStatic, std::string signature, WrenForeignMethodFn function);
+    RegisteredClassContext& bindSetter(Signature signature, bool trackChanges = false);
+    RegisteredClassContext& bindCFunction(bool isStatic, Signature signature, WrenForeignMethodFn function);
+    template <typename F>
+    RegisteredClassContext& bindFunctor(bool isStatic, Signature signature, F functor);
+
+    /// Declares that T derives from Base, which must be bound before this call, and must not be a
+    /// virtual base. Base's instance methods and properties are bound on this class too, since
+    /// Wren's foreign classes can't inherit from each other, and a T can be passed wherever a
+    /// Base is expected.
+    template <typename Base>
+    RegisteredClassContext& inherits();
 };
 
 class ModuleContext
@@ -854,15 +1853,59 @@ class ModuleContext
 public:
     ModuleContext() = delete;
     ModuleContext(WrenVM* vm, std::string mod)
-        : _vm(vm)
+        : _bindings(&detail::boundTable(vm))
+        , _vm(vm)
+        , _name(mod)
+    {
+    }
+    ModuleContext(detail::BindingTable* bindings, std::string mod)
+        : _bindings(bindings)
         , _name(mod)
     {
     }
 
     ClassContext beginClass(std::string className);
 
+    /// Binds T as a foreign class, constructed from Args. The constructor is called
+    /// `constructor` in the generated Wren declaration of the class.
     template <typename T, typename... Args>
-    RegisteredClassContext<T> bindClass(std::string className);
+    RegisteredClassContext<T> bindClass(std::string className, std::string constructor = "new");
+
+    /// Binds NumericBuffer<T> along with all of its bulk operations. The Wren class needs a
+    /// `construct new(count)` constructor.
+    template <typename T>
+    RegisteredClassContext<NumericBuffer<T> > bindNumericBuffer(std::string className);
+
+    /// Binds MappedFile along with its typed accessors. The Wren class needs a
+    /// `construct open(path)` constructor.
+    RegisteredClassContext<MappedFile> bindMappedFile(std::string className);
+
+    /// Binds ByteBuffer. The Wren class needs a `construct new()` constructor.
+    RegisteredClassContext<ByteBuffer> bindByteBuffer(std::string className);
+
+    /// Binds StringBuilder. The Wren class needs a `construct new()` constructor.
+    RegisteredClassContext<StringBuilder> bindStringBuilder(std::string className);
+
+    /// Binds Channel. The Wren class needs a `construct open(name, capacity)` constructor.
+    /// Received byte buffers are created as instances of the bound ByteBuffer class.
+    RegisteredClassContext<Channel> bindChannel(std::string className);
+
+    /// Binds `parse(text)`, which decodes JSON straight into Wren lists, maps and values, and
+    /// `stringify(value)` as static methods of a class. Without map support in the slot API,
+    /// objects are decoded as lists of [key, value] pairs.
+    ClassContext bindJson(std::string className);
+
+    /// Binds JsonDocument. The Wren class needs a `construct parse(text)` constructor.
+    /// Containers found by `[path]` are created as instances of the bound class.
+    RegisteredClassContext<JsonDocument> bindJsonDocument(std::string className);
+
+    /// Binds JsonWriter. The Wren class needs a `construct new()` constructor.
+    RegisteredClassContext<JsonWriter> bindJsonWriter(std::string className);
+
+    /// Importing the module compiles Wren declarations generated from its bindings, instead of
+    /// loading its source through loadModuleFn. Only for modules which contain no Wren code of
+    /// their own.
+    ModuleContext& generateDeclarations();
 
     void endModule();
 
@@ -871,8 +1914,30 @@ private:
     template <typename T>
     friend class RegisteredClassContext;
 
-    WrenVM*     _vm;
-    std::string _name;
+    detail::BindingTable* _bindings;
+    WrenVM*               _vm {nullptr};  // nullptr when building a BindingSet
+    std::string           _name;
+};
+
+/// A set of bindings which is built once and can then be shared by any number of VMs, so that
+/// creating a VM does no per-binding work. Build it with the same module, class and method
+/// binding calls that VM::beginModule offers.
+///
+/// The set must be complete before any VM using it runs, and must outlive those VMs.
+class BindingSet
+{
+public:
+    BindingSet();
+    BindingSet(const BindingSet&) = delete;
+    BindingSet& operator=(const BindingSet&) = delete;
+    ~BindingSet();
+
+    ModuleContext beginModule(std::string name);
+
+private:
+    friend class VM;
+
+    std::unique_ptr<detail::BindingTable> _table;
 };
 
 enum class Result
@@ -882,10 +1947,73 @@ enum class Result
     RuntimeError
 };
 
+/// Records what every thread spends its time on in Wren: running modules and strings, calling
+/// Methods and bound functions, and collecting garbage. The trace can be viewed in
+/// chrome://tracing or Perfetto.
+///
+/// Each thread records into its own buffer, without locking. When a thread's buffer is full,
+/// further events on it are dropped.
+class Tracer
+{
+public:
+    static void start();
+    static void stop();
+
+    /// Writes the events recorded so far in Chrome's JSON trace event format. The buffers of
+    /// threads which have exited are then reused by new threads.
+    static void write(std::ostream& out);
+
+    /// Discards the events recorded so far. No thread may be running Wren while this runs.
+    static void clear();
+};
+
+/// The result of replaying a recording, see replay.
+struct ReplayReport
+{
+    std::size_t calls;
+    std::size_t skipped;  // calls with arguments which couldn't be recorded
+    std::size_t failed;   // calls which raised a runtime error
+    double      seconds;  // spent in calls
+    double      p50;      // call latencies, in microseconds
+    double      p90;
+    double      p99;
+};
+
+/// Replays a recording made with VM::startRecording. The VM must be bound like the recorded
+/// one; executeString and executeModule are run again as recorded, and every Method call is
+/// timed. Throws std::runtime_error if the recording is malformed.
+ReplayReport replay(VM& vm, std::istream& recording);
+
+/// The foreign objects of one bound class which are alive in a VM, see VM::census.
+struct CensusEntry
+{
+    std::string className;
+    std::size_t live;
+    std::size_t bytes;  // in the Wren heap
+    std::size_t peakLive;
+    std::size_t peakBytes;
+};
+
+/// The calls to one bound function, see VM::profile.
+struct ProfileEntry
+{
+    std::string   name;  // module.Class.signature
+    std::uint64_t calls;
+    std::uint64_t totalNanoseconds;
+    /// bucket i counts the calls which took [2^i, 2^(i+1)) nanoseconds; the last bucket also
+    /// counts all longer calls
+    std::array<std::uint64_t, 32> histogram;
+};
+
+/// Binds the classes and functions of one module, see VM::deferModule.
+using ModuleBinder = std::function<void(ModuleContext&)>;
+
 class VM
 {
 public:
     VM();
+    /// Creates a VM which sees the bindings of the set, in addition to its own.
+    explicit VM(const BindingSet& bindings);
     VM(const VM&) = delete;
     VM(VM&&);
     VM& operator=(const VM&) = delete;
@@ -909,13 +2037,76 @@ public:
 
     /// The signature consists of the name of the method, followed by a
     /// parenthesis enclosed list of of underscores representing each argument.
+    /// The VM caches the call handles it makes for signatures, so looking a method up again
+    /// makes no new call handle. The variable is read on each lookup, so that a Method calls
+    /// what the variable holds at the time.
     Method method(const std::string& module, const std::string& variable, const std::string& signature);
     Method method(WrenHandle* variable, const std::string& signature);
 
+    /// A signature which can be called on any receiver. The call handle is shared with the
+    /// VM's Methods through the handle cache.
+    CallSignature signature(const std::string& signature);
+
+    /// Releases the cached handles which no Method uses any more, and returns how many
+    /// were released. Unless the VM is recording, the call sites no Method uses are dropped too.
+    std::size_t trimHandles();
+    std::size_t cachedHandles() const;
+
     ModuleContext beginModule(std::string name);
 
-    static LoadModuleFn loadModuleFn;
-    static WriteFn      writeFn;
+    /// Makes the bindings of the set visible to this VM. The VM's own bindings take precedence,
+    /// followed by the sets in the order they were added.
+    void useBindings(const BindingSet& bindings);
+
+    /// Defers binding a module until Wren first asks for a foreign class or method in it,
+    /// so that a script only pays for the modules it imports. The binder is called at most
+    /// once, with the module's context.
+    void deferModule(std::string name, ModuleBinder binder);
+
+    /// Turns timing of bound functions, getters, setters and constructors on or off. Timing is
+    /// only compiled in when WRENPP_PROFILE is defined, for Wren++ and all code binding to it.
+    void setProfiling(bool enabled);
+
+    /// The calls timed so far, sorted by total time, the most expensive first.
+    std::vector<ProfileEntry> profile() const;
+
+    /// The foreign objects alive in this VM, per bound class, sorted by bytes, the largest first.
+    std::vector<CensusEntry> census() const;
+
+    /// Starts the census's peaks over from the current counts.
+    void resetCensusPeaks();
+
+    /// Calls visit with each T changed through a tracked setter or method since the last drain,
+    /// once per object, and empties the set. Objects of classes derived from T are visited too.
+    /// visit may call into the VM: objects which are collected before they're visited are
+    /// skipped, and objects changed during the drain are left for the next one. Returns how
+    /// many objects were visited.
+    template <typename T, typename F>
+    std::size_t drainDirty(F&& visit);
+
+    /// Records executeString, executeModule, Method and CallSignature calls into the stream,
+    /// until stopRecording, so that they can be replayed later. Arguments which are null,
+    /// booleans, numbers, strings or values of trivially copyable bound classes are recorded;
+    /// calls with other arguments are replayed as skipped. Methods made from a handle and
+    /// CallSignatures record their receiver like an argument.
+    void startRecording(std::ostream& out);
+    void stopRecording();
+
+    /// Queues a task to be run on the thread which owns this VM, the next time it calls
+    /// drainInbox. This never blocks, and may be called from any thread.
+    void post(std::function<void(VM&)> task);
+
+    /// Posts a call of the method, whose result is delivered through the returned future. The
+    /// arguments are copied, but the method itself must stay alive until the call has run.
+    template <typename... Args>
+    std::future<Value> call(const Method& method, Args... args);
+
+    /// Runs up to maxTasks posted tasks in the order they were posted, and returns the number
+    /// of tasks which were run. Only the thread which owns the VM may call this.
+    std::size_t drainInbox(std::size_t maxTasks = std::size_t(-1));
+
+    static LoadModuleFn loadModuleFn;
+    static WriteFn      writeFn;
     static ReallocateFn reallocateFn;
     static ErrorFn      errorFn;
     static std::size_t  initialHeapSize;
@@ -927,12 +2118,82 @@ private:
     friend class ModuleContext;
     friend class ClassContext;
     friend class Method;
+    friend class CallSignature;
     template <typename T>
     friend class RegisteredClassContext;
 
     WrenVM* _vm;
 };
 
+/// Keeps a number of VMs set up and ready to use, so that a fresh VM can be handed out for each
+/// request without paying for VM creation, bindings and module loading. Returned VMs are never
+/// reused: a background thread destroys them and sets up replacements.
+///
+/// The setup function runs on the background thread, except for the VMs created when the pool
+/// is constructed, and when the pool runs dry.
+class VMPool
+{
+public:
+    using SetupFn = std::function<void(VM&)>;
+
+    /// A VM on loan from the pool, which is returned when the lease is destroyed.
+    class Lease
+    {
+    public:
+        Lease(VMPool* pool, std::unique_ptr<VM> vm);
+        Lease(const Lease&) = delete;
+        Lease(Lease&&)      = default;
+        Lease& operator=(const Lease&) = delete;
+        Lease& operator=(Lease&&) = delete;
+        ~Lease();
+
+        VM& operator*() const
+        {
+            return *_vm;
+        }
+
+        VM* operator->() const
+        {
+            return _vm.get();
+        }
+
+    private:
+        VMPool*             _pool;
+        std::unique_ptr<VM> _vm;
+    };
+
+    /// Creates `standby` VMs up front, running `setup` on each of them.
+    VMPool(std::size_t standby, SetupFn setup);
+    VMPool(const VMPool&) = delete;
+    VMPool& operator=(const VMPool&) = delete;
+    /// The pool must outlive all of its leases.
+    ~VMPool();
+
+    /// Hands out a ready VM, or sets one up on the calling thread if none is ready. If setting
+    /// up a VM on the pool's thread threw, and no VM is ready, that exception is rethrown here,
+    /// and the pool's thread resumes setting up VMs.
+    Lease acquire();
+
+    /// The number of VMs which are currently ready to be handed out.
+    std::size_t ready() const;
+
+private:
+    void                release(std::unique_ptr<VM> vm);
+    std::unique_ptr<VM> create() const;
+    void                run();
+
+    const std::size_t                _standby;
+    const SetupFn                    _setup;
+    mutable std::mutex               _mutex{};
+    std::condition_variable          _wake{};
+    std::vector<std::unique_ptr<VM> > _ready{};
+    std::vector<std::unique_ptr<VM> > _retired{};
+    bool                             _stopping{false};
+    // thrown by the setup function on the worker, which doesn't set up VMs until it is taken
+    std::exception_ptr               _failure{};
+    std::thread                      _worker{};
+};
+
 template <typename T>
 Value::Value(T* t)
     : _type{WREN_TYPE_FOREIGN}
@@ -976,104 +2237,270 @@ inline const char* Value::as<const char*>() const
     return _string;
 }
 
-template <typename... Args>
-Value Method::operator()(Args... args) const
+namespace detail
 {
-    assert(_vm && _variable && _method);
-    constexpr const std::size_t Arity = sizeof...(Args);
-    wrenEnsureSlots(_vm->ptr(), Arity + 1u);
-    wrenSetSlotHandle(_vm->ptr(), 0, _variable);
-
-    std::tuple<Args...> tuple = std::make_tuple(args...);
-    detail::passArgumentsToWren(_vm->ptr(), tuple, std::make_index_sequence<Arity>{});
-
-    auto result = wrenCall(_vm->ptr(), _method);
+    /// Calls the method on the receiver, leaving the result in slot 0. The receiver may be
+    /// anything WrenSlotAPI can put in a slot, such as a WrenHandle* or a pointer to an
+    /// instance of a bound class.
+    template <typename Receiver, typename... Args>
+    WrenInterpretResult callWren(WrenVM* vm, WrenHandle* method, const CallSite* site, Receiver receiver,
+                                 Args... args)
+    {
+        constexpr const std::size_t Arity = sizeof...(Args);
+        wrenEnsureSlots(vm, Arity + 1u);
+        WrenSlotAPI<Receiver>::set(vm, 0, receiver);
+
+        std::tuple<Args...> tuple = std::make_tuple(args...);
+        passArgumentsToWren(vm, tuple, std::make_index_sequence<Arity>{});
+        recordCall(vm, site, static_cast<int>(Arity));
+
+        return wrenCall(vm, method);
+    }
 
-    if (result == WREN_RESULT_SUCCESS)
+    inline Value resultValue(WrenVM* vm)
     {
-        WrenType type = wrenGetSlotType(_vm->ptr(), 0);
+        WrenType type = wrenGetSlotType(vm, 0);
 
         switch (type)
         {
             case WREN_TYPE_BOOL:
-                return Value(wrenGetSlotBool(_vm->ptr(), 0));
+                return Value(wrenGetSlotBool(vm, 0));
             case WREN_TYPE_NUM:
-                return Value(wrenGetSlotDouble(_vm->ptr(), 0));
+                return Value(wrenGetSlotDouble(vm, 0));
             case WREN_TYPE_STRING:
-                return Value(wrenGetSlotString(_vm->ptr(), 0));
+                return Value(wrenGetSlotString(vm, 0));
             case WREN_TYPE_FOREIGN:
-                return Value(wrenGetSlotForeign(_vm->ptr(), 0));
+                return Value(wrenGetSlotForeign(vm, 0));
             default:
                 assert("Invalid Wren type");
                 break;
         }
+
+        return null;
+    }
+}
+
+template <typename... Args>
+Value Method::operator()(Args... args) const
+{
+    assert(_vm && _variable && _method);
+    detail::TraceScope trace(_site, "Method");
+    if (detail::callWren(_vm->ptr(), _method, _site, _variable, args...) == WREN_RESULT_SUCCESS)
+    {
+        return detail::resultValue(_vm->ptr());
     }
 
     return null;
 }
 
+template <typename Receiver, typename... Args>
+Value CallSignature::operator()(Receiver receiver, Args... args) const
+{
+    assert(_vm && _method);
+    detail::TraceScope trace(_site, "CallSignature");
+    if (detail::callWren(_vm->ptr(), _method, _site, receiver, args...) == WREN_RESULT_SUCCESS)
+    {
+        return detail::resultValue(_vm->ptr());
+    }
+
+    return null;
+}
+
+namespace detail
+{
+    template <typename R>
+    R functionResult(WrenVM* vm, WrenInterpretResult result)
+    {
+        return result == WREN_RESULT_SUCCESS ? WrenSlotAPI<R>::get(vm, 0) : R{};
+    }
+
+    template <>
+    inline void functionResult<void>(WrenVM*, WrenInterpretResult)
+    {
+    }
+}
+
+template <typename R, typename... Args>
+R Function<R(Args...)>::operator()(Args... args) const
+{
+    assert(_handles);
+    detail::TraceScope trace("Function");
+    WrenVM*            vm = _handles->vm;
+    return detail::functionResult<R>(vm, detail::callWren(vm, _handles->call, nullptr, _handles->closure, args...));
+}
+
+template <typename Iterator, typename... Args>
+std::size_t CallSignature::forEach(Iterator first, Iterator last, Args... args) const
+{
+    assert(_vm && _method);
+    detail::TraceScope trace(_site, "CallSignature");
+    std::size_t        succeeded = 0u;
+    for (; first != last; ++first)
+    {
+        if (detail::callWren(_vm->ptr(), _method, _site, *first, args...) == WREN_RESULT_SUCCESS)
+        {
+            ++succeeded;
+        }
+    }
+    return succeeded;
+}
+
+template <typename T, typename F>
+std::size_t VM::drainDirty(F&& visit)
+{
+    // objects are in the dirty sets of their own types, which may be derived from T
+    const std::uint32_t base    = detail::getTypeId<T>();
+    const std::uint32_t types   = detail::censusTypes(_vm);
+    std::size_t         visited = 0u;
+    for (std::uint32_t id = 0u; id < types; ++id)
+    {
+        detail::TypeCensus& census = detail::typeCensus(_vm, id);
+        if (census.dirty.empty() || (id != base && detail::upcastOffset(id, base) == detail::noUpcast))
+        {
+            continue;
+        }
+
+        // Swap the set out, so that visiting may dirty objects for the next drain. The objects
+        // stay in the swapped out set until they're visited, so that if visiting collects one,
+        // its destructor takes it out.
+        assert(census.draining.empty());
+        census.draining.swap(census.dirty);
+        for (detail::ForeignObject* object : census.draining)
+        {
+            object->markDraining();
+        }
+        while (!census.draining.empty())
+        {
+            detail::ForeignObject* object = census.draining.back();
+            census.draining.pop_back();
+            object->markClean();
+            if (object->expired())
+            {
+                continue;
+            }
+            if (T* t = detail::objectAs<T>(object))
+            {
+                visit(*t);
+                ++visited;
+            }
+        }
+    }
+    return visited;
+}
+
+template <typename... Args>
+std::future<Value> VM::call(const Method& method, Args... args)
+{
+    auto               promise = std::make_shared<std::promise<Value> >();
+    std::future<Value> future  = promise->get_future();
+    post([promise, &method, args...](VM&) { promise->set_value(method(args...)); });
+    return future;
+}
+
 template <typename T, typename... Args>
-RegisteredClassContext<T> ModuleContext::bindClass(std::string className)
+RegisteredClassContext<T> ModuleContext::bindClass(std::string className, std::string constructor)
 {
     WrenForeignClassMethods wrapper{&detail::allocate<T, Args...>, &detail::finalize<T>};
-    detail::registerClass(_vm, _name, className, wrapper);
-
-    // store the name and module if not already done
-    if (detail::classNameStorage().size() == detail::getTypeId<T>())
+    constructor += '(';
+    for (std::size_t i = 0u; i < sizeof...(Args); ++i)
     {
-        assert(detail::classNameStorage().size() == detail::moduleNameStorage().size());
-        detail::bindTypeToModuleName<T>(_name);
-        detail::bindTypeToClassName<T>(className);
+        constructor += i == 0u ? "_" : ",_";
     }
+    constructor += ')';
+    detail::registerClass(*_bindings, _name, className, constructor, wrapper);
+    detail::storeTypeNames<T>(_name, className);
+    detail::registerRecordable<T>(std::is_trivially_copyable<T>{});
     return RegisteredClassContext<T>(className, *this);
 }
 
 template <typename F, F f>
-ClassContext& ClassContext::bindFunction(bool isStatic, std::string s)
+ClassContext& ClassContext::bindFunction(bool isStatic, Signature s)
 {
-    detail::registerFunction(_module._vm, _module._name, _class, isStatic, s,
+    detail::registerFunction(*_module._bindings, _module._name, _class, isStatic, s,
                              detail::ForeignMethodWrapper<decltype(f), f>::call);
     return *this;
 }
 
+template <typename F>
+ClassContext& ClassContext::bindFunctor(bool isStatic, Signature s, F functor)
+{
+    detail::registerFunctor(*_module._bindings, _module._name, _class, isStatic, s,
+                            std::make_shared<F>(std::move(functor)), &detail::invokeFunctor<F>);
+    return *this;
+}
+
 template <typename T>
 template <typename F, F f>
-RegisteredClassContext<T>& RegisteredClassContext<T>::bindMethod(bool isStatic, std::string s)
+RegisteredClassContext<T>& RegisteredClassContext<T>::bindMethod(bool isStatic, Signature s, bool trackChanges)
 {
-    detail::registerFunction(_module._vm, _module._name, _class, isStatic, s,
-                             detail::ForeignMethodWrapper<decltype(f), f>::call);
+    detail::registerFunction(*_module._bindings, _module._name, _class, isStatic, s,
+                             trackChanges ? detail::TrackedMethodWrapper<decltype(f), f>::call
+                                          : detail::ForeignMethodWrapper<decltype(f), f>::call);
     return *this;
 }
 
 template <typename T>
 template <typename U, U T::*Field>
-RegisteredClassContext<T>& RegisteredClassContext<T>::bindGetter(std::string s)
+RegisteredClassContext<T>& RegisteredClassContext<T>::bindGetter(Signature s)
 {
-    detail::registerFunction(_module._vm, _module._name, _class, false, s, detail::propertyGetter<T, U, Field>);
+    detail::registerFunction(*_module._bindings, _module._name, _class, false, s, detail::propertyGetter<T, U, Field>);
     return *this;
 }
 
 template <typename T>
 template <typename U, U T::*Field>
-RegisteredClassContext<T>& RegisteredClassContext<T>::bindSetter(std::string s)
+RegisteredClassContext<T>& RegisteredClassContext<T>::bindSetter(Signature s, bool trackChanges)
 {
-    detail::registerFunction(_module._vm, _module._name, _class, false, s, detail::propertySetter<T, U, Field>);
+    detail::registerFunction(*_module._bindings, _module._name, _class, false, s,
+                             trackChanges ? detail::propertySetter<T, U, Field, true>
+                                          : detail::propertySetter<T, U, Field, false>);
     return *this;
 }
 
 template <typename T>
-RegisteredClassContext<T>& RegisteredClassContext<T>::bindCFunction(bool isStatic, std::string s,
+RegisteredClassContext<T>& RegisteredClassContext<T>::bindCFunction(bool isStatic, Signature s,
                                                                     WrenForeignMethodFn function)
 {
-    detail::registerFunction(_module._vm, _module._name, _class, isStatic, s, function);
+    detail::registerFunction(*_module._bindings, _module._name, _class, isStatic, s, function);
+    return *this;
+}
+
+template <typename T>
+template <typename F>
+RegisteredClassContext<T>& RegisteredClassContext<T>::bindFunctor(bool isStatic, Signature s, F functor)
+{
+    ClassContext::bindFunctor(isStatic, s, std::move(functor));
     return *this;
 }
 
+template <typename T>
+template <typename Base>
+RegisteredClassContext<T>& RegisteredClassContext<T>::inherits()
+{
+    static_assert(std::is_base_of<Base, T>::value, "T must derive from Base");
+    detail::registerUpcast(detail::getTypeId<T>(), detail::getTypeId<Base>(), detail::baseOffset<T, Base>());
+    detail::inheritMethods(_module._vm, *_module._bindings, detail::getWrenModuleString<Base>(),
+                           detail::getWrenClassString<Base>(), _module._name, _class);
+    return *this;
+}
+
+/// Returns nullptr, and aborts the fiber, if the slot holds a stale Handle, or if T isn't const
+/// but the object is read-only.
 template <typename T>
 T* getSlotForeign(WrenVM* vm, int slot)
 {
     detail::ForeignObject* obj = static_cast<detail::ForeignObject*>(wrenGetSlotForeign(vm, slot));
-    return static_cast<T*>(obj->objectPtr());
+    if (obj->expired())
+    {
+        detail::abortFiber(vm, "the object behind this handle has been removed");
+        return nullptr;
+    }
+    if (!std::is_const<T>::value && obj->readOnly())
+    {
+        detail::abortFiber(vm, "this object is read-only");
+        return nullptr;
+    }
+    return detail::objectAs<T>(obj);
 }
 
 template <typename T>
@@ -1087,6 +2514,787 @@ void setSlotForeignPtr(WrenVM* vm, int slot, T* obj)
 {
     detail::ForeignObjectPtr<T>::setInSlot(vm, slot, obj);
 }
+
+/// A fixed-size array of numbers with bulk operations. Each operation processes the whole
+/// buffer in a single foreign call, instead of one call per element.
+template <typename T>
+class NumericBuffer
+{
+    static_assert(std::is_floating_point<T>::value, "NumericBuffer holds float or double");
+
+public:
+    explicit NumericBuffer(std::size_t count)
+        : _data(count, T(0))
+    {
+    }
+
+    std::size_t count() const
+    {
+        return _data.size();
+    }
+
+    T* data()
+    {
+        return _data.data();
+    }
+
+    const T* data() const
+    {
+        return _data.data();
+    }
+
+    T get(std::size_t index) const
+    {
+        checkIndex(index);
+        return _data[index];
+    }
+
+    void set(std::size_t index, T value)
+    {
+        checkIndex(index);
+        _data[index] = value;
+    }
+
+    void fill(T value)
+    {
+        std::fill(_data.begin(), _data.end(), value);
+    }
+
+    /// this[i] += rhs[i]
+    void add(const NumericBuffer& rhs)
+    {
+        checkCount(rhs);
+        detail::addKernel(_data.data(), rhs.data(), _data.size());
+    }
+
+    /// this[i] *= rhs[i]
+    void mul(const NumericBuffer& rhs)
+    {
+        checkCount(rhs);
+        detail::mulKernel(_data.data(), rhs.data(), _data.size());
+    }
+
+    /// this[i] += a[i] * b[i]
+    void fma(const NumericBuffer& a, const NumericBuffer& b)
+    {
+        checkCount(a);
+        checkCount(b);
+        detail::fmaKernel(_data.data(), a.data(), b.data(), _data.size());
+    }
+
+    /// this[i] *= factor
+    void scale(T factor)
+    {
+        detail::scaleKernel(_data.data(), factor, _data.size());
+    }
+
+    T dot(const NumericBuffer& rhs) const
+    {
+        checkCount(rhs);
+        return detail::dotKernel(_data.data(), rhs.data(), _data.size());
+    }
+
+    T sum() const
+    {
+        return detail::sumKernel(_data.data(), _data.size());
+    }
+
+    T min() const
+    {
+        checkNotEmpty();
+        return detail::minKernel(_data.data(), _data.size());
+    }
+
+    T max() const
+    {
+        checkNotEmpty();
+        return detail::maxKernel(_data.data(), _data.size());
+    }
+
+    /// this[i] = source[indices[i]]
+    void gather(const NumericBuffer& source, const NumericBuffer& indices)
+    {
+        checkCount(indices);
+        for (std::size_t i = 0u; i < _data.size(); ++i)
+        {
+            _data[i] = source.get(detail::toUnsigned<std::size_t>(double(indices._data[i])));
+        }
+    }
+
+    /// target[indices[i]] = this[i]
+    void scatter(NumericBuffer& target, const NumericBuffer& indices) const
+    {
+        checkCount(indices);
+        for (std::size_t i = 0u; i < _data.size(); ++i)
+        {
+            target.set(detail::toUnsigned<std::size_t>(double(indices._data[i])), _data[i]);
+        }
+    }
+
+private:
+    void checkIndex(std::size_t index) const
+    {
+        if (index >= _data.size())
+        {
+            throw std::out_of_range("buffer index out of bounds");
+        }
+    }
+
+    void checkCount(const NumericBuffer& other) const
+    {
+        if (other.count() != _data.size())
+        {
+            throw std::invalid_argument("buffer counts don't match");
+        }
+    }
+
+    void checkNotEmpty() const
+    {
+        if (_data.empty())
+        {
+            throw std::logic_error("buffer is empty");
+        }
+    }
+
+    std::vector<T> _data;
+};
+
+using FloatBuffer  = NumericBuffer<float>;
+using DoubleBuffer = NumericBuffer<double>;
+
+namespace detail
+{
+    class FileMapping;
+
+    template <typename F>
+    struct IsConstMethod : std::false_type
+    {
+    };
+
+    template <typename R, typename C, typename... Args>
+    struct IsConstMethod<R (C::*)(Args...) const> : std::true_type
+    {
+    };
+
+    template <typename T>
+    struct PublishedObject
+    {
+        static const T* object;
+    };
+
+    template <typename T>
+    const T* PublishedObject<T>::object = nullptr;
+
+    template <typename T>
+    void getPublishedObject(WrenVM* vm)
+    {
+        ForeignObjectPtr<const T>::setInSlot(vm, 0, PublishedObject<T>::object);
+    }
+
+    template <typename T>
+    void restoreForeignValue(WrenVM* vm, int slot, const void* bytes)
+    {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        std::memcpy(&storage, bytes, sizeof(T));
+        ForeignObjectValue<T>::setInSlot(vm, slot, *reinterpret_cast<const T*>(&storage));
+    }
+
+    inline void allocatePublished(WrenVM* vm)
+    {
+        // there is no object to construct, but finalize still needs something to destroy
+        void* memory = wrenSetSlotNewForeign(vm, 0, 0, sizeof(ForeignObjectPtr<void>));
+        new (memory) ForeignObjectPtr<void>{nullptr};
+        abortFiber(vm, "published objects can't be constructed");
+    }
+}
+
+/// A read-only view into a memory-mapped file. The file contents are never copied into the
+/// Wren heap, and a file is mapped only once per process: every MappedFile opened with the
+/// same path, in any VM, shares the mapping. The mapping is released with the last view.
+///
+/// Values are read in the host's byte order.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path);
+
+    std::size_t count() const
+    {
+        return _size;
+    }
+
+    const std::uint8_t* data() const
+    {
+        return _data;
+    }
+
+    unsigned u8(std::size_t offset) const
+    {
+        return read<std::uint8_t>(offset);
+    }
+
+    unsigned u16(std::size_t offset) const
+    {
+        return read<std::uint16_t>(offset);
+    }
+
+    unsigned u32(std::size_t offset) const
+    {
+        return read<std::uint32_t>(offset);
+    }
+
+    float f32(std::size_t offset) const
+    {
+        return read<float>(offset);
+    }
+
+    double f64(std::size_t offset) const
+    {
+        return read<double>(offset);
+    }
+
+    /// Returns a view of `length` bytes starting at `offset`, sharing this view's mapping.
+    MappedFile slice(std::size_t offset, std::size_t length) const;
+
+private:
+    MappedFile(std::shared_ptr<const detail::FileMapping> mapping, const std::uint8_t* data, std::size_t size);
+
+    template <typename U>
+    U read(std::size_t offset) const
+    {
+        if (offset > _size || _size - offset < sizeof(U))
+        {
+            throw std::out_of_range("read past the end of the mapped file");
+        }
+        U value;
+        std::memcpy(&value, _data + offset, sizeof(U));
+        return value;
+    }
+
+    std::shared_ptr<const detail::FileMapping> _mapping;
+    const std::uint8_t*                        _data;
+    std::size_t                                _size;
+};
+
+/// A growable array of bytes. Byte buffers are moved, not copied, when sent over a Channel.
+class ByteBuffer
+{
+public:
+    ByteBuffer() = default;
+
+    explicit ByteBuffer(std::vector<std::uint8_t> bytes)
+        : _bytes(std::move(bytes))
+    {
+    }
+
+    std::size_t count() const
+    {
+        return _bytes.size();
+    }
+
+    unsigned get(std::size_t index) const
+    {
+        checkIndex(index);
+        return _bytes[index];
+    }
+
+    void set(std::size_t index, unsigned byte)
+    {
+        checkIndex(index);
+        _bytes[index] = std::uint8_t(byte);
+    }
+
+    void add(unsigned byte)
+    {
+        _bytes.push_back(std::uint8_t(byte));
+    }
+
+    void clear()
+    {
+        _bytes.clear();
+    }
+
+    void append(const char* data, std::size_t length)
+    {
+        _bytes.insert(_bytes.end(), reinterpret_cast<const std::uint8_t*>(data),
+                      reinterpret_cast<const std::uint8_t*>(data) + length);
+    }
+
+    std::vector<std::uint8_t>& bytes()
+    {
+        return _bytes;
+    }
+
+    const std::vector<std::uint8_t>& bytes() const
+    {
+        return _bytes;
+    }
+
+    // foreign methods
+    static void addBytesFromWren(WrenVM* vm);
+    static void toStringFromWren(WrenVM* vm);
+
+private:
+    void checkIndex(std::size_t index) const
+    {
+        if (index >= _bytes.size())
+        {
+            throw std::out_of_range("byte index out of bounds");
+        }
+    }
+
+    std::vector<std::uint8_t> _bytes;
+};
+
+/// Builds a string in a buffer which grows geometrically, so that appending takes amortised
+/// constant time, and no Wren string exists until toString is called.
+///
+/// Wren's `add(_)`, `addLine(_)`, `padLeft(_,_)` and `padRight(_,_)` take strings, numbers,
+/// booleans, null, byte buffers and string builders, and return the builder, so that calls
+/// can be chained. Numbers are formatted as Wren formats them.
+class StringBuilder
+{
+public:
+    StringBuilder() = default;
+
+    StringBuilder& add(const char* text, std::size_t length)
+    {
+        _text.append(text, length);
+        return *this;
+    }
+
+    StringBuilder& add(const std::string& text)
+    {
+        _text += text;
+        return *this;
+    }
+
+    StringBuilder& add(double number);
+
+    /// formats the number with the given number of digits after the point, at most 20
+    StringBuilder& addFixed(double number, int digits);
+
+    /// pads what was added since `start` with spaces, up to `width` code points
+    StringBuilder& pad(std::size_t start, std::size_t width, bool left);
+
+    void reserve(std::size_t bytes)
+    {
+        _text.reserve(bytes);
+    }
+
+    /// the length in bytes
+    std::size_t count() const
+    {
+        return _text.size();
+    }
+
+    /// empties the builder, but keeps its capacity
+    void clear()
+    {
+        _text.clear();
+    }
+
+    const std::string& text() const
+    {
+        return _text;
+    }
+
+    // foreign methods
+    static void addFromWren(WrenVM* vm);
+    static void addLineFromWren(WrenVM* vm);
+    static void addFixedFromWren(WrenVM* vm);
+    static void padLeftFromWren(WrenVM* vm);
+    static void padRightFromWren(WrenVM* vm);
+    static void toStringFromWren(WrenVM* vm);
+
+private:
+    // appends the value in the slot, throwing if it can't be added
+    void        addSlot(WrenVM* vm, int slot);
+    static void padFromWren(WrenVM* vm, bool left);
+
+    std::string _text{};
+};
+
+/// A JSON text which is validated when parsed, but only decoded where it is queried. Paths
+/// select values by object key and array index, separated by dots, as in "users.0.name". The
+/// empty path selects the whole document.
+///
+/// Wren sees a document as a foreign class with `[path]`, which decodes scalars and returns
+/// containers as documents of their own, sharing the text, `has(path)`, `count(path)`,
+/// `decode(path)`, which decodes the whole value, and `toString`, which returns its JSON text.
+class JsonDocument
+{
+public:
+    /// throws std::runtime_error, naming the offset, if the text isn't valid JSON
+    explicit JsonDocument(std::string text);
+
+    /// a view of the value between begin and end, which must already be valid JSON
+    JsonDocument(std::shared_ptr<const std::string> text, std::size_t begin, std::size_t end);
+
+    bool has(const std::string& path) const;
+
+    /// the number of elements or members of the array or object at the path
+    std::size_t count(const std::string& path) const;
+
+    /// throws std::out_of_range if there is no value at the path
+    JsonDocument at(const std::string& path) const;
+
+    std::string text() const
+    {
+        return _text->substr(_begin, _end - _begin);
+    }
+
+    // foreign methods
+    static void getFromWren(WrenVM* vm);
+    static void decodeFromWren(WrenVM* vm);
+    static void toStringFromWren(WrenVM* vm);
+
+private:
+    // finds the value at the path, returning false if there isn't one
+    bool find(const std::string& path, std::size_t& begin, std::size_t& end) const;
+
+    std::shared_ptr<const std::string> _text;
+    std::size_t                        _begin;
+    std::size_t                        _end;
+};
+
+/// Writes JSON into a buffer which is kept between documents: clear() empties it, but keeps
+/// its capacity, so a writer reused for many documents stops allocating once it has grown.
+///
+/// Wren's `value(_)` writes null, booleans, numbers, strings, lists and documents. Maps can't
+/// be read through the slot API, so objects are written with beginObject, key and endObject.
+class JsonWriter
+{
+public:
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+    void key(const std::string& name);
+
+    void null();
+    void boolean(bool value);
+    /// NaN and infinities, which JSON can't represent, are written as null
+    void number(double value);
+    void string(const char* text, std::size_t length);
+    void string(const std::string& text)
+    {
+        string(text.data(), text.size());
+    }
+    /// writes text, which must be a valid JSON value, as it is
+    void raw(const char* json, std::size_t length);
+
+    const std::string& text() const
+    {
+        return _text;
+    }
+
+    std::size_t count() const
+    {
+        return _text.size();
+    }
+
+    void clear();
+
+    // foreign methods
+    static void valueFromWren(WrenVM* vm);
+    static void toStringFromWren(WrenVM* vm);
+
+private:
+    // writes the comma between values, and checks that a value may be written here
+    void beginValue();
+    void endContainer(char bracket);
+    void escape(const char* text, std::size_t length);
+
+    std::string _text{};
+    // one entry per open container, true while it is still empty
+    std::vector<bool> _empty{};
+    std::string       _open{};
+    bool              _afterKey{false};
+};
+
+namespace detail
+{
+    /// A bounded, lock-free multi-producer multi-consumer queue, after Dmitry Vyukov's design.
+    /// The capacity is rounded up to a power of two.
+    template <typename T>
+    class BoundedQueue
+    {
+    public:
+        /// throws std::length_error if the capacity can't be rounded up to a power of two
+        explicit BoundedQueue(std::size_t capacity)
+            : _cells(nullptr)
+            , _mask(0u)
+        {
+            if (capacity > std::numeric_limits<std::size_t>::max() / 2u + 1u)
+            {
+                throw std::length_error("channel capacity is too large");
+            }
+            std::size_t size = 2u;
+            while (size < capacity)
+            {
+                size <<= 1u;
+            }
+            _cells.reset(new Cell[size]);
+            _mask = size - 1u;
+            for (std::size_t i = 0u; i < size; ++i)
+            {
+                _cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        BoundedQueue(const BoundedQueue&) = delete;
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+        std::size_t capacity() const
+        {
+            return _mask + 1u;
+        }
+
+        /// returns false without consuming the value if the queue is full
+        bool push(T& value)
+        {
+            Cell*       cell;
+            std::size_t position = _enqueue.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                cell                 = &_cells[position & _mask];
+                std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff  = std::ptrdiff_t(sequence) - std::ptrdiff_t(position);
+                if (diff == 0)
+                {
+                    if (_enqueue.compare_exchange_weak(position, position + 1u, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    position = _enqueue.load(std::memory_order_relaxed);
+                }
+            }
+            cell->value = std::move(value);
+            cell->sequence.store(position + 1u, std::memory_order_release);
+            return true;
+        }
+
+        /// returns false if the queue is empty
+        bool pop(T& value)
+        {
+            Cell*       cell;
+            std::size_t position = _dequeue.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                cell                 = &_cells[position & _mask];
+                std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff  = std::ptrdiff_t(sequence) - std::ptrdiff_t(position + 1u);
+                if (diff == 0)
+                {
+                    if (_dequeue.compare_exchange_weak(position, position + 1u, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    position = _dequeue.load(std::memory_order_relaxed);
+                }
+            }
+            value = std::move(cell->value);
+            cell->sequence.store(position + _mask + 1u, std::memory_order_release);
+            return true;
+        }
+
+        /// only a snapshot, as other threads may be pushing and popping
+        bool empty() const
+        {
+            return _enqueue.load(std::memory_order_acquire) == _dequeue.load(std::memory_order_acquire);
+        }
+
+    private:
+        struct Cell
+        {
+            std::atomic<std::size_t> sequence;
+            T                        value;
+        };
+
+        // keep producers and consumers from sharing a cache line
+        static constexpr std::size_t CacheLine = 64u;
+
+        std::unique_ptr<Cell[]>  _cells;
+        std::size_t              _mask;
+        char                     _pad0[CacheLine];
+        std::atomic<std::size_t> _enqueue{0u};
+        char                     _pad1[CacheLine];
+        std::atomic<std::size_t> _dequeue{0u};
+        char                     _pad2[CacheLine];
+    };
+}
+
+/// A value passed over a Channel. Strings and byte buffers keep their contents in `bytes`.
+struct ChannelMessage
+{
+    enum class Type
+    {
+        Null,
+        Bool,
+        Number,
+        String,
+        Bytes
+    };
+
+    Type                      type{Type::Null};
+    double                    number{0.0};
+    std::vector<std::uint8_t> bytes{};
+};
+
+/// A bounded lock-free queue for passing messages between VMs, which may run on different
+/// threads. Channels opened with the same name share one queue, which lives for as long as
+/// any Channel refers to it. The capacity given by the first opener is used.
+///
+/// Wren sees a channel as a foreign class with `send(_)`, which returns false when the channel
+/// is full, and `poll()`, which moves the next message into `received` and returns true if
+/// there was one. Polling never blocks, so a fiber can wait on many channels by polling each
+/// and yielding when none of them has a message.
+class Channel
+{
+public:
+    Channel(const std::string& name, std::size_t capacity);
+
+    /// creates an anonymous channel, which can be handed to VMs with setSlotForeignValue
+    explicit Channel(std::size_t capacity);
+
+    /// returns false, leaving the message intact, if the channel is full
+    bool send(ChannelMessage& message)
+    {
+        return _queue->push(message);
+    }
+
+    /// returns false if the channel is empty
+    bool receive(ChannelMessage& message)
+    {
+        return _queue->pop(message);
+    }
+
+    std::size_t capacity() const
+    {
+        return _queue->capacity();
+    }
+
+    bool empty() const
+    {
+        return _queue->empty();
+    }
+
+    // foreign methods
+    static void sendFromWren(WrenVM* vm);
+    static void pollFromWren(WrenVM* vm);
+    static void receivedFromWren(WrenVM* vm);
+
+private:
+    std::shared_ptr<detail::BoundedQueue<ChannelMessage> > _queue;
+    // the last message taken by poll(), owned by this handle
+    ChannelMessage _received{};
+};
+
+/// Binds the methods of a published object. Only const methods, static functions and
+/// getters can be bound, since the object is shared by every VM in the process.
+template <typename T>
+class PublishedClassContext
+{
+public:
+    PublishedClassContext(std::string mod, std::string className)
+        : _module(std::move(mod))
+        , _class(std::move(className))
+    {
+    }
+
+    template <typename F, F f>
+    PublishedClassContext& bindMethod(bool isStatic, Signature signature)
+    {
+        static_assert(detail::IsConstMethod<F>::value || !std::is_member_function_pointer<F>::value,
+                      "published objects are immutable, so only const methods can be bound");
+        detail::registerFunction(detail::publishedTable(), _module, _class, isStatic, signature,
+                                 detail::ForeignMethodWrapper<F, f>::call);
+        return *this;
+    }
+
+    template <typename U, U T::*Field>
+    PublishedClassContext& bindGetter(Signature signature)
+    {
+        detail::registerFunction(detail::publishedTable(), _module, _class, false, signature,
+                                 detail::propertyGetter<T, U, Field>);
+        return *this;
+    }
+
+private:
+    std::string _module;
+    std::string _class;
+};
+
+/// Publishes an immutable object once for the whole process. Every VM can reach it through a
+/// static getter on the given foreign class, without copying it into its own heap:
+///
+///     foreign class Config {
+///         foreign static instance
+///         foreign lookup(key)
+///     }
+///     var config = Config.instance
+///
+/// The object must outlive every VM, and only one object of each type, and one class of each
+/// name, can be published; publishing another throws std::logic_error. Publish objects before
+/// starting VMs on other threads, as the published bindings are read without locking.
+///
+/// Wren can pass the object, and objects in its fields, only to functions taking them by value
+/// or by const reference or pointer.
+template <typename T>
+PublishedClassContext<T> publish(const T& object, std::string mod, std::string className,
+                                 std::string getter = "instance")
+{
+    if (detail::PublishedObject<T>::object != nullptr)
+    {
+        throw std::logic_error("an object of this type was already published");
+    }
+    if (detail::hasClass(detail::publishedTable(), mod, className))
+    {
+        throw std::logic_error("a class named " + className + " was already published in " + mod);
+    }
+    detail::PublishedObject<T>::object = &object;
+    detail::storeTypeNames<T>(mod, className);
+    detail::registerClass(detail::publishedTable(), mod, className, std::string(),
+                          WrenForeignClassMethods{&detail::allocatePublished, &detail::finalize<T>});
+    detail::registerFunction(detail::publishedTable(), mod, className, true, getter, &detail::getPublishedObject<T>);
+    return PublishedClassContext<T>(std::move(mod), std::move(className));
+}
+
+template <typename T>
+RegisteredClassContext<NumericBuffer<T> > ModuleContext::bindNumericBuffer(std::string className)
+{
+    using Buffer = NumericBuffer<T>;
+    return bindClass<Buffer, std::size_t>(className)
+        .template bindMethod<decltype(&Buffer::count), &Buffer::count>(false, "count")
+        .template bindMethod<decltype(&Buffer::get), &Buffer::get>(false, "[_]")
+        .template bindMethod<decltype(&Buffer::set), &Buffer::set>(false, "[_]=(_)")
+        .template bindMethod<decltype(&Buffer::fill), &Buffer::fill>(false, "fill(_)")
+        .template bindMethod<decltype(&Buffer::add), &Buffer::add>(false, "add(_)")
+        .template bindMethod<decltype(&Buffer::mul), &Buffer::mul>(false, "mul(_)")
+        .template bindMethod<decltype(&Buffer::fma), &Buffer::fma>(false, "fma(_,_)")
+        .template bindMethod<decltype(&Buffer::scale), &Buffer::scale>(false, "scale(_)")
+        .template bindMethod<decltype(&Buffer::dot), &Buffer::dot>(false, "dot(_)")
+        .template bindMethod<decltype(&Buffer::sum), &Buffer::sum>(false, "sum()")
+        .template bindMethod<decltype(&Buffer::min), &Buffer::min>(false, "min()")
+        .template bindMethod<decltype(&Buffer::max), &Buffer::max>(false, "max()")
+        .template bindMethod<decltype(&Buffer::gather), &Buffer::gather>(false, "gather(_,_)")
+        .template bindMethod<decltype(&Buffer::scatter), &Buffer::scatter>(false, "scatter(_,_)");
+}
 }
 
 #endif  // WRENPP_H_INCLUDED
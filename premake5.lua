@@ -10,6 +10,19 @@ newoption {
     description = "The location of the wren static lib"
 }
 
+newoption {
+    trigger     = "profile",
+    description = "Time the calls to bound functions (defines WRENPP_PROFILE)"
+}
+
+newaction {
+    trigger     = "size",
+    description = "Report the bytes of code generated for bound functions in bin/test",
+    execute     = function()
+        os.execute("sh tools/binding-size.sh bin/test -v")
+    end
+}
+
 workspace "wrenpp"
     if _ACTION then
         -- guard this in case the user is calling `premake5 --help`
@@ -19,6 +32,10 @@ workspace "wrenpp"
     configurations { "Debug", "Release" }
     platforms { "Win32", "x64" }
 
+    if _OPTIONS["profile"] then
+        defines { "WRENPP_PROFILE" }
+    end
+
     filter "platforms:Win32"
         architecture "x86"
 
@@ -57,6 +74,7 @@ workspace "wrenpp"
         targetdir "bin"
         targetname "test"
         files { "Wren++.cpp", "test/**.cpp", "test/***.h", "test/**.wren" }
+        removefiles { "test/alloc/**" }
         includedirs { "./", "test" }
         if _OPTIONS["include"] then
             includedirs { _OPTIONS["include"] }
@@ -82,4 +100,52 @@ workspace "wrenpp"
             links { "lib", "wren_static" }
 
         filter { "not action:vs*" }
-            links { "lib", "wren" }
+            links { "lib", "wren", "pthread" }
+
+    project "alloc"
+        kind "ConsoleApp"
+        language "C++"
+        targetdir "bin"
+        targetname "alloc"
+        files { "test/alloc/**.cpp" }
+        includedirs { "./" }
+        if _OPTIONS["include"] then
+            includedirs { _OPTIONS["include"] }
+        end
+        if _OPTIONS["link"] then
+            libdirs { _OPTIONS["link"] }
+        end
+        -- a change which adds allocations to a hot path fails the build
+        postbuildcommands { "\"%{cfg.buildtarget.abspath}\"" }
+
+        filter { "action:vs*", "Debug" }
+            links { "lib", "wren_static_d" }
+
+        filter { "action:vs*", "Release"}
+            links { "lib", "wren_static" }
+
+        filter { "not action:vs*" }
+            links { "lib", "wren", "pthread" }
+
+    project "replay"
+        kind "ConsoleApp"
+        language "C++"
+        targetdir "bin"
+        targetname "replay"
+        files { "tools/Replay.cpp" }
+        includedirs { "./" }
+        if _OPTIONS["include"] then
+            includedirs { _OPTIONS["include"] }
+        end
+        if _OPTIONS["link"] then
+            libdirs { _OPTIONS["link"] }
+        end
+
+        filter { "action:vs*", "Debug" }
+            links { "lib", "wren_static_d" }
+
+        filter { "action:vs*", "Release"}
+            links { "lib", "wren_static" }
+
+        filter { "not action:vs*" }
+            links { "lib", "wren", "pthread" }
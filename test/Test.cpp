@@ -3,6 +3,14 @@
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 // a small class to test class & method binding with
 struct Vec3
@@ -38,6 +46,24 @@ struct Vec3
     {
         return Vec3{ x + rhs.x, y + rhs.y, z + rhs.z };
     }
+
+    float normalize()
+    {
+        const float length = norm();
+        x /= length;
+        y /= length;
+        z /= length;
+        return length;
+    }
+
+    Vec3 flip()
+    {
+        const Vec3 old = *this;
+        x = -x;
+        y = -y;
+        z = -z;
+        return old;
+    }
 };
 
 struct Transform
@@ -49,6 +75,18 @@ struct Transform
     Vec3 position{ 0.f, 0.f, 0.f };
 };
 
+// a read-only table shared by all VMs
+struct Config
+{
+    int              version;
+    std::vector<int> table;
+
+    int lookup(int index) const
+    {
+        return table.at(index);
+    }
+};
+
 void CFunctionVectorReference(WrenVM* vm)
 {
     static Vec3 v{ 2.0, 1.0, 1.0 };
@@ -151,7 +189,7 @@ void testReturnValues()
 {
     wrenpp::VM vm{};
 
-    vm.executeString(
+    vm.executeString("main",
         "var returnsThree = Fn.new {\n"
         "    return 3\n"
         "}\n"
@@ -199,7 +237,7 @@ void testStrings()
             .bindFunction<decltype(&printCharString), printCharString>(true, "print3(_)")
         .endClass();
 
-    vm.executeString(
+    vm.executeString("main",
         "class StringPrinter {\n"
         "  foreign static print1(str)\n"
         "  foreign static print2(str)\n"
@@ -207,9 +245,833 @@ void testStrings()
         "}\n"
     );
 
-    vm.executeString("StringPrinter.print1(\"passing by const ref works\")");
-    vm.executeString("StringPrinter.print2(\"passing by value works\")");
-    vm.executeString("StringPrinter.print3(\"passing as C string works\")");
+    vm.executeString("main", "StringPrinter.print1(\"passing by const ref works\")");
+    vm.executeString("main", "StringPrinter.print2(\"passing by value works\")");
+    vm.executeString("main", "StringPrinter.print3(\"passing as C string works\")");
+}
+
+void testNumericBuffers()
+{
+    wrenpp::VM vm;
+    vm.beginModule("buffer")
+        .bindNumericBuffer<float>("FloatBuffer")
+        .endClass()
+    .endModule();
+    vm.executeModule("test_buffer");
+}
+
+void testMappedFiles()
+{
+    {
+        std::ofstream file("mapped.bin", std::ios::binary);
+        std::uint32_t header[2] = {1u, 123456u};
+        double        value     = 0.25;
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    wrenpp::VM vm;
+    vm.beginModule("mapped")
+        .bindMappedFile("MappedFile")
+        .endClass()
+    .endModule();
+    vm.executeModule("test_mapped");
+}
+
+void resetConfig(Config& config)
+{
+    config.version = 0;
+}
+
+void testPublishedObjects()
+{
+    static const Config config{3, {0, 10, 20}};
+    wrenpp::publish(config, "config", "Config")
+        .bindGetter<decltype(Config::version), &Config::version>("version")
+        .bindMethod<decltype(&Config::lookup), &Config::lookup>(false, "lookup(_)");
+
+    // each VM sees the same object, without binding anything itself
+    wrenpp::VM vm1;
+    vm1.executeModule("test_published");
+    wrenpp::VM vm2;
+    vm2.executeModule("test_published");
+
+    // the object can't be passed where it could be changed
+    vm2.beginModule("reset")
+        .beginClass("Reset")
+            .bindFunction< decltype(&resetConfig), &resetConfig >(true, "config(_)")
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+    assert(vm2.executeString("main", "import \"config\" for Config\nimport \"reset\" for Reset\nReset.config(Config.instance)") == wrenpp::Result::RuntimeError);
+    assert(config.version == 3);
+
+    bool republished = false;
+    try
+    {
+        wrenpp::publish(config, "config", "Config");
+    }
+    catch (const std::logic_error&)
+    {
+        republished = true;
+    }
+    assert(republished);
+}
+
+void bindChannelModule(wrenpp::VM& vm)
+{
+    vm.beginModule("channel")
+        .bindByteBuffer("ByteBuffer")
+        .endClass()
+        .bindChannel("Channel")
+        .endClass()
+    .endModule();
+}
+
+void testChannels()
+{
+    wrenpp::VM sender;
+    bindChannelModule(sender);
+    sender.executeString("main",
+        "import \"channel\" for Channel, ByteBuffer\n"
+        "var pipe = Channel.open(\"pipe\", 4)\n"
+        "pipe.send(42)\n"
+        "pipe.send(true)\n"
+        "pipe.send(\"hello\")\n"
+        "var bytes = ByteBuffer.new()\n"
+        "bytes.add(1)\n"
+        "bytes.add(2)\n"
+        "bytes.add(255)\n"
+        "pipe.send(bytes)\n"
+        "if (bytes.count != 0) Fiber.abort(\"bytes were copied\")\n"
+        "if (pipe.send(0)) Fiber.abort(\"channel should be full\")\n"
+    );
+
+    wrenpp::VM receiver;
+    bindChannelModule(receiver);
+    receiver.executeModule("test_channel");
+}
+
+void testChannelThreads()
+{
+    // several producers and consumers share one small queue, and every message must arrive once
+    constexpr int          producers   = 4;
+    constexpr int          perProducer = 10000;
+    constexpr int          total       = producers * perProducer;
+    wrenpp::Channel        channel(16u);
+    std::atomic<int>       received{0};
+    std::atomic<long long> sum{0};
+
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p)
+    {
+        threads.emplace_back([&channel, p]() {
+            for (int i = 0; i < perProducer; ++i)
+            {
+                wrenpp::ChannelMessage message;
+                message.type   = wrenpp::ChannelMessage::Type::Number;
+                message.number = double(p * perProducer + i);
+                while (!channel.send(message))
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (int c = 0; c < 2; ++c)
+    {
+        threads.emplace_back([&]() {
+            wrenpp::ChannelMessage message;
+            while (received.load() < total)
+            {
+                if (channel.receive(message))
+                {
+                    sum += static_cast<long long>(message.number);
+                    ++received;
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    assert(received.load() == total);
+    assert(sum.load() == static_cast<long long>(total) * (total - 1) / 2);
+    assert(channel.empty());
+
+    bool rejected = false;
+    try
+    {
+        wrenpp::Channel huge(std::size_t(-1));
+    }
+    catch (const std::length_error&)
+    {
+        rejected = true;
+    }
+    assert(rejected);
+}
+
+void testInbox()
+{
+    wrenpp::VM vm;
+    vm.executeString("main", "var add = Fn.new { |a, b| a + b }");
+    wrenpp::Method add = vm.method("main", "add", "call(_,_)");
+
+    std::future<wrenpp::Value> sum;
+    int                        posted = 0;
+    std::thread                producer([&]() {
+        for (int i = 0; i < 100; ++i)
+        {
+            vm.post([&posted](wrenpp::VM&) { ++posted; });
+        }
+        sum = vm.call(add, 2.0, 3.0);
+    });
+    producer.join();
+
+    assert(vm.drainInbox(10u) == 10u);
+    assert(vm.drainInbox() == 91u);
+    assert(posted == 100);
+    assert(sum.get().as<double>() == 5.0);
+    assert(vm.drainInbox() == 0u);
+}
+
+void testVMPool()
+{
+    wrenpp::VMPool pool(2u, [](wrenpp::VM& vm) {
+        bindVectorModule(vm);
+        vm.executeString("main", "import \"vector\" for Vec3\nvar length = Fn.new { Vec3.new(3, 4, 0).norm() }");
+    });
+    assert(pool.ready() == 2u);
+
+    {
+        // one more than the pool holds, so the last one is set up on demand
+        wrenpp::VMPool::Lease a = pool.acquire();
+        wrenpp::VMPool::Lease b = pool.acquire();
+        wrenpp::VMPool::Lease c = pool.acquire();
+        wrenpp::Method        length = c->method("main", "length", "call()");
+        assert(length().as<double>() == 5.0);
+    }
+
+    // the returned VMs are replaced in the background
+    for (int i = 0; i < 1000 && pool.ready() < 2u; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    assert(pool.ready() == 2u);
+}
+
+void testVMPoolSetupFailure()
+{
+    // the standby VMs are set up, and every VM after them fails
+    std::atomic<int> setups{0};
+    wrenpp::VMPool   pool(1u, [&setups](wrenpp::VM&) {
+        if (++setups > 1)
+        {
+            throw std::runtime_error("setup failed");
+        }
+    });
+
+    wrenpp::VMPool::Lease first = pool.acquire();
+    for (int i = 0; i < 2; ++i)
+    {
+        // thrown by the pool's thread, or by the calling thread if the pool's hasn't run yet
+        bool thrown = false;
+        try
+        {
+            pool.acquire();
+        }
+        catch (const std::runtime_error&)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
+void testBindingSet()
+{
+    wrenpp::BindingSet bindings;
+    bindings.beginModule("vector")
+        .bindClass<Vec3, float, float, float>("Vec3")
+            .bindGetter< decltype(Vec3::x), &Vec3::x >("x")
+            .bindMethod< decltype(&Vec3::norm), &Vec3::norm >(false, "norm()")
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+
+    // both VMs resolve the foreign methods from the same table
+    wrenpp::VM first(bindings);
+    wrenpp::VM second(bindings);
+    for (wrenpp::VM* vm : {&first, &second})
+    {
+        vm->executeString("main", "import \"vector\" for Vec3\nvar length = Fn.new { Vec3.new(3, 4, 0).norm() }");
+        wrenpp::Method length = vm->method("main", "length", "call()");
+        assert(length().as<double>() == 5.0);
+    }
+}
+
+void testSignatureHashing()
+{
+    constexpr wrenpp::Signature norm {"norm()"};
+    static_assert(norm.hash() == wrenpp::detail::hashString("norm()"), "constexpr signatures hash at compile time");
+
+    wrenpp::VM vm;
+    vm.beginModule("vector")
+        .bindClass<Vec3, float, float, float>("Vec3")
+            .bindMethod< decltype(&Vec3::norm), &Vec3::norm >(false, norm)
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+    vm.executeString("main", "import \"vector\" for Vec3\nvar length = Fn.new { Vec3.new(3, 4, 0).norm() }");
+    assert(vm.method("main", "length", "call()")().as<double>() == 5.0);
+
+    // signatures which collide must not find each other's bindings, also after the table grows
+    wrenpp::detail::SignatureMap<int> map;
+    for (int i = 0; i < 100; ++i)
+    {
+        map.insert(42u, "main", "Class", false, "method" + std::to_string(i) + "()", i);
+    }
+    map.insert(42u, "main", "Class", true, "method0()", 100);
+    map.insert(42u, "main", "Class", false, "method0()", 101);
+    assert(map.size() == 101u);
+    for (int i = 0; i < 100; ++i)
+    {
+        const int* value = map.find(42u, "main", "Class", false, ("method" + std::to_string(i) + "()").c_str());
+        assert(value && *value == i);
+    }
+    assert(*map.find(42u, "main", "Class", true, "method0()") == 100);
+    assert(map.find(42u, "main", "Other", false, "method0()") == nullptr);
+    assert(map.find(43u, "main", "Class", false, "method0()") == nullptr);
+}
+
+void testDeferredModules()
+{
+    int        vectorBinds = 0;
+    bool       unusedBound = false;
+    wrenpp::VM vm;
+    vm.deferModule("vector", [&vectorBinds](wrenpp::ModuleContext& module) {
+        ++vectorBinds;
+        module.bindClass<Vec3, float, float, float>("Vec3")
+            .bindMethod< decltype(&Vec3::norm), &Vec3::norm >(false, "norm()")
+        .endClass();
+    });
+    vm.deferModule("transform", [&unusedBound](wrenpp::ModuleContext&) { unusedBound = true; });
+    assert(vectorBinds == 0);
+
+    vm.executeString("main", "import \"vector\" for Vec3\nvar length = Fn.new { Vec3.new(3, 4, 0).norm() }");
+    wrenpp::Method length = vm.method("main", "length", "call()");
+    assert(length().as<double>() == 5.0);
+    assert(vectorBinds == 1);
+    assert(!unusedBound);
+}
+
+void testProfiling()
+{
+    wrenpp::VM vm;
+    bindVectorModule(vm);
+    vm.setProfiling(true);
+    vm.executeString("main", "import \"vector\" for Vec3\nvar v = Vec3.new(3, 4, 0)\nfor (i in 1..10) v.norm()");
+
+    std::vector<wrenpp::ProfileEntry> profile = vm.profile();
+#if defined(WRENPP_PROFILE)
+    auto norm = std::find_if(profile.begin(), profile.end(),
+                             [](const wrenpp::ProfileEntry& e) { return e.name == "vector.Vec3.norm()"; });
+    assert(norm != profile.end());
+    assert(norm->calls == 10u);
+    for (std::size_t i = 1u; i < profile.size(); ++i)
+    {
+        assert(profile[i - 1u].totalNanoseconds >= profile[i].totalNanoseconds);
+    }
+#else
+    assert(profile.empty());
+#endif
+}
+
+void testTracing()
+{
+    wrenpp::VM vm;
+    bindVectorModule(vm);
+    vm.executeString("main", "import \"vector\" for Vec3\nvar add = Fn.new { |a, b| a + b }\nvar v = Vec3.new(3, 4, 0)");
+    wrenpp::Method add  = vm.method("main", "add", "call(_,_)");
+    wrenpp::Method norm = vm.method("main", "v", "norm()");
+
+    wrenpp::Tracer::start();
+    assert(add(1, 2).as<double>() == 3.0);
+    assert(norm().as<double>() == 5.0);
+    vm.collectGarbage();
+    wrenpp::Tracer::stop();
+    add(3, 4);
+
+    std::ostringstream trace;
+    wrenpp::Tracer::write(trace);
+    wrenpp::Tracer::clear();
+    const std::string json = trace.str();
+    assert(json.find("\"name\":\"main.add.call(_,_)\",\"ph\":\"B\"") != std::string::npos);
+    assert(json.find("\"name\":\"collectGarbage\",\"ph\":\"E\"") != std::string::npos);
+    assert(json.find("\"name\":\"vector.Vec3.norm()\",\"ph\":\"B\"") != std::string::npos);
+    // only the call made while tracing was recorded, as one begin and one end event
+    std::size_t calls = 0u;
+    for (std::size_t at = json.find("main.add"); at != std::string::npos; at = json.find("main.add", at + 1u))
+    {
+        ++calls;
+    }
+    assert(calls == 2u);
+}
+
+void testCensus()
+{
+    wrenpp::VM vm;
+    bindVectorModule(vm);
+    vm.executeString("main", "import \"vector\" for Vec3\nvar vectors = [Vec3.new(1, 0, 0), Vec3.new(0, 1, 0)]\nvectors.add(vectors[0].plus(vectors[1]))");
+
+    auto vec3 = [&vm]() {
+        std::vector<wrenpp::CensusEntry> census = vm.census();
+        auto entry = std::find_if(census.begin(), census.end(),
+                                  [](const wrenpp::CensusEntry& e) { return e.className == "Vec3"; });
+        assert(entry != census.end());
+        return *entry;
+    };
+    assert(vec3().live == 3u);
+    assert(vec3().bytes == 3u * sizeof(wrenpp::detail::ForeignObjectValue<Vec3>));
+
+    vm.executeString("main", "vectors = null");
+    vm.collectGarbage();
+    assert(vec3().live == 0u);
+    assert(vec3().bytes == 0u);
+    assert(vec3().peakLive == 3u);
+}
+
+void testRecordReplay()
+{
+    std::stringstream recording;
+    {
+        wrenpp::VM vm;
+        bindVectorModule(vm);
+        vm.startRecording(recording);
+        vm.executeString("main", "import \"vector\" for Vec3\nvar dot = Fn.new { |a, b| a.dot(b) }\nvar greet = Fn.new { |name| \"hi \" + name }");
+        wrenpp::Method dot   = vm.method("main", "dot", "call(_,_)");
+        wrenpp::Method greet = vm.method("main", "greet", "call(_)");
+        assert(dot(Vec3{1.f, 2.f, 3.f}, Vec3{1.f, 1.f, 1.f}).as<double>() == 6.0);
+        greet("you");
+        greet("me");
+        // the receiver of a call signature is recorded with the call
+        assert(vm.signature("norm()")(Vec3{3.f, 4.f, 0.f}).as<double>() == 5.0);
+        // trimming while recording keeps the call sites the recording refers to
+        vm.trimHandles();
+        wrenpp::CallSignature norm = vm.signature("norm()");
+        assert(norm(Vec3{3.f, 4.f, 0.f}).as<double>() == 5.0);
+        vm.stopRecording();
+        greet("not recorded");
+    }
+
+    // a fresh VM with the same bindings reruns the script and the calls
+    wrenpp::VM vm;
+    bindVectorModule(vm);
+    wrenpp::ReplayReport report = wrenpp::replay(vm, recording);
+    assert(report.calls == 5u);
+    assert(report.skipped == 0u);
+    assert(report.failed == 0u);
+    assert(report.p50 <= report.p90 && report.p90 <= report.p99);
+}
+
+void testHandleCache()
+{
+    wrenpp::VM vm;
+    vm.executeString("main", "var add = Fn.new { |a, b| a + b }\nvar sub = Fn.new { |a, b| a - b }");
+    {
+        wrenpp::Method add   = vm.method("main", "add", "call(_,_)");
+        wrenpp::Method again = vm.method("main", "add", "call(_,_)");
+        wrenpp::Method sub   = vm.method("main", "sub", "call(_,_)");
+        // one call(_,_) handle shared between all three
+        assert(vm.cachedHandles() == 1u);
+        assert(add(3, 2).as<double>() == 5.0);
+        assert(again(3, 2).as<double>() == 5.0);
+        assert(sub(3, 2).as<double>() == 1.0);
+        assert(vm.trimHandles() == 0u);
+
+        // looking the variable up again finds what it holds now
+        vm.executeString("main", "add = Fn.new { |a, b| a * b }");
+        assert(add(3, 2).as<double>() == 5.0);
+        assert(vm.method("main", "add", "call(_,_)")(3, 2).as<double>() == 6.0);
+    }
+    assert(vm.cachedHandles() == 1u);
+    assert(vm.trimHandles() == 1u);
+    assert(vm.cachedHandles() == 0u);
+}
+
+wrenpp::Function<double(double, double)> storedCombine;
+wrenpp::Function<void(const char*)>      storedListener;
+
+void storeCallbacks(wrenpp::Function<double(double, double)> combine, wrenpp::Function<void(const char*)> listener)
+{
+    storedCombine  = combine;
+    storedListener = listener;
+}
+
+void testFunctions()
+{
+    wrenpp::VM vm;
+    vm.beginModule("main")
+        .beginClass("Callbacks")
+            .bindFunction<decltype(&storeCallbacks), &storeCallbacks>(true, "store(_,_)")
+        .endClass()
+    .endModule();
+    vm.executeString("main", "class Callbacks {\n  foreign static store(combine, listener)\n}\nvar heard = null\nCallbacks.store(Fn.new { |a, b| a * b }, Fn.new { |event| heard = event })");
+
+    assert(storedCombine(3.0, 4.0) == 12.0);
+    assert(storedCombine(0.5, 4.0) == 2.0);
+    storedListener("clicked");
+    assert(vm.method("main", "heard", "toString")().as<const char*>() == std::string("clicked"));
+
+    storedCombine  = wrenpp::Function<double(double, double)>();
+    storedListener = wrenpp::Function<void(const char*)>();
+}
+
+void testFunctors()
+{
+    std::vector<std::string> log;
+    int                      next = 0;
+
+    wrenpp::VM vm;
+    vm.beginModule("main")
+        .beginClass("Service")
+            .bindFunctor(true, "log(_)", [&log](std::string line) { log.push_back(line); })
+            .bindFunctor(true, "next()", [&next]() { return ++next; })
+        .endClass()
+    .endModule();
+    vm.executeString("main", "class Service {\n  foreign static log(line)\n  foreign static next()\n}\nService.log(\"started\")\nService.log(\"id %(Service.next() + Service.next())\")");
+
+    assert(next == 2);
+    assert(log.size() == 2u);
+    assert(log[0] == "started");
+    assert(log[1] == "id 3");
+
+    // each VM gives its functors thunks of its own
+    int        other = 100;
+    wrenpp::VM second;
+    second.beginModule("main")
+        .beginClass("Service")
+            .bindFunctor(true, "next()", [&other]() { return ++other; })
+        .endClass()
+    .endModule();
+    second.executeString("main", "class Service {\n  foreign static next()\n}\nService.next()");
+    vm.executeString("main", "Service.next()");
+    assert(next == 3);
+    assert(other == 101);
+}
+
+void testDirtyTracking()
+{
+    wrenpp::VM vm;
+    vm.beginModule("vector")
+        .bindClass<Vec3, float, float, float>("Vec3")
+            .bindGetter< decltype(Vec3::x), &Vec3::x >("x")
+            .bindSetter< decltype(Vec3::x), &Vec3::x >("x=(_)", true)
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+    vm.executeString("main", "import \"vector\" for Vec3\nvar a = Vec3.new(1, 0, 0)\nvar b = Vec3.new(2, 0, 0)\nvar c = Vec3.new(3, 0, 0)\na.x = 10\nc.x = 30\nc.x = b.x + 29");
+
+    // a and c changed, c only once as far as the dirty set is concerned
+    float sum = 0.f;
+    assert(vm.drainDirty<Vec3>([&sum](Vec3& v) { sum += v.x; }) == 2u);
+    assert(sum == 41.f);
+    assert(vm.drainDirty<Vec3>([](Vec3&) { assert(false); }) == 0u);
+
+    vm.executeString("main", "b.x = 0");
+    assert(vm.drainDirty<Vec3>([](Vec3& v) { assert(v.x == 0.f); }) == 1u);
+
+    // tracked methods mark their receiver, even though their result replaces it in slot 0
+    wrenpp::VM methods;
+    methods.beginModule("vector")
+        .bindClass<Vec3, float, float, float>("Vec3")
+            .bindMethod< decltype(&Vec3::normalize), &Vec3::normalize >(false, "normalize()", true)
+            .bindMethod< decltype(&Vec3::flip), &Vec3::flip >(false, "flip()", true)
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+    assert(methods.executeString("main",
+        "import \"vector\" for Vec3\n"
+        "var a = Vec3.new(3, 0, 4)\n"
+        "var b = Vec3.new(1, 0, 0)\n"
+        "if (a.normalize() != 5) Fiber.abort(\"normalize\")\n"
+        "if (b.flip().x != 1) Fiber.abort(\"flip\")"
+    ) == wrenpp::Result::Success);
+    float xs = 0.f;
+    assert(methods.drainDirty<Vec3>([&xs](Vec3& v) { xs += v.x; }) == 2u);
+    assert(xs == 0.6f - 1.f);
+}
+
+struct Entity
+{
+    int hp;
+};
+
+bool isLive(wrenpp::Handle<Entity> handle)
+{
+    return wrenpp::HandleTable<Entity>::get(handle) != nullptr;
+}
+
+void testHandles()
+{
+    using Entities = wrenpp::HandleTable<Entity>;
+
+    wrenpp::VM vm;
+    vm.beginModule("entity")
+        .bindClass<Entity, int>("Entity")
+            .bindGetter< decltype(Entity::hp), &Entity::hp >("hp")
+        .endClass()
+        .beginClass("Entities")
+            .bindFunction< decltype(&isLive), &isLive >(true, "isLive(_)")
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+    vm.executeString("main", "import \"entity\" for Entity, Entities\nvar held = null\nvar hold = Fn.new { |e| held = e }");
+
+    Entity                 entity{10};
+    wrenpp::Handle<Entity> handle = Entities::insert(&entity);
+    vm.method("main", "hold", "call(_)")(handle);
+    assert(vm.executeString("main", "if (held.hp != 10) Fiber.abort(\"wrong hp\")") == wrenpp::Result::Success);
+    assert(vm.executeString("main", "if (!Entities.isLive(held)) Fiber.abort(\"not live\")") == wrenpp::Result::Success);
+    // an entity which isn't a handle can't be passed as one
+    assert(vm.executeString("main", "Entities.isLive(Entity.new(5))") == wrenpp::Result::RuntimeError);
+    assert(vm.executeString("main", "Entities.isLive(5)") == wrenpp::Result::RuntimeError);
+
+    // the host removes the entity while Wren still holds it
+    Entities::remove(handle);
+    assert(vm.executeString("main", "held.hp") == wrenpp::Result::RuntimeError);
+
+    // a new entity in the same slot doesn't bring the old handle back
+    Entity                 other{20};
+    wrenpp::Handle<Entity> reused = Entities::insert(&other);
+    assert(reused.slot == handle.slot);
+    assert(Entities::get(handle) == nullptr);
+    assert(Entities::get(reused) == &other);
+    assert(vm.executeString("main", "held.hp") == wrenpp::Result::RuntimeError);
+    Entities::remove(reused);
+}
+
+struct Tagged
+{
+    double tag{0.0};
+};
+
+struct Animal
+{
+    explicit Animal(int legs)
+        : legs(legs)
+    {
+    }
+
+    int legCount() const
+    {
+        return legs;
+    }
+
+    int legs;
+};
+
+// Animal isn't the first base, so upcasting has to move the pointer
+struct Dog : Tagged, Animal
+{
+    explicit Dog(int legs)
+        : Animal(legs)
+    {
+    }
+
+    // hides Animal::legCount, for binding as an override
+    int legCount() const
+    {
+        return legs + 1;
+    }
+
+    bool wagging{true};
+};
+
+int countLegs(const Animal& animal)
+{
+    return animal.legs;
+}
+
+void testInheritance()
+{
+    wrenpp::VM vm;
+    vm.beginModule("animals")
+        .bindClass<Animal, int>("Animal")
+            .bindMethod< decltype(&Animal::legCount), &Animal::legCount >(false, "legCount()")
+            .bindGetter< decltype(Animal::legs), &Animal::legs >("legs")
+            .bindSetter< decltype(Animal::legs), &Animal::legs >("legs=(_)", true)
+        .endClass()
+        .bindClass<Dog, int>("Dog")
+            .inherits<Animal>()
+            .bindGetter< decltype(Dog::wagging), &Dog::wagging >("wagging")
+        .endClass()
+        .beginClass("Zoo")
+            .bindFunction< decltype(&countLegs), &countLegs >(true, "countLegs(_)")
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+
+    assert(vm.executeString("main", "import \"animals\" for Animal, Dog, Zoo\nvar dog = Dog.new(3)\nif (dog.legCount() != 3 || dog.legs != 3 || !dog.wagging) Fiber.abort(\"inherited methods\")\nif (Zoo.countLegs(dog) != 3 || Zoo.countLegs(Animal.new(2)) != 2) Fiber.abort(\"upcast arguments\")") == wrenpp::Result::Success);
+
+    // a dog changed through the inherited tracked setter is drained as an animal
+    assert(vm.executeString("main", "dog.legs = 4") == wrenpp::Result::Success);
+    assert(vm.drainDirty<Animal>([](Animal& animal) { assert(animal.legs == 4); }) == 1u);
+
+    // the base may be in a binding set, and the derived class may override it after inheriting
+    wrenpp::BindingSet animals;
+    animals.beginModule("animals")
+        .bindClass<Animal, int>("Animal")
+            .bindMethod< decltype(&Animal::legCount), &Animal::legCount >(false, "legCount()")
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+    wrenpp::VM overriding(animals);
+    overriding.beginModule("dogs")
+        .bindClass<Dog, int>("Dog")
+            .inherits<Animal>()
+            .bindMethod< decltype(&Dog::legCount), &Dog::legCount >(false, "legCount()")
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+    assert(overriding.executeString("main", "import \"dogs\" for Dog\nif (Dog.new(4).legCount() != 5) Fiber.abort(\"override\")") == wrenpp::Result::Success);
+
+    // a base which isn't bound is an error
+    wrenpp::VM orphan;
+    bool       thrown = false;
+    try
+    {
+        orphan.beginModule("dogs").bindClass<Dog, int>("Dog").inherits<Animal>();
+    }
+    catch (const std::logic_error&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void testCallSignature()
+{
+    wrenpp::VM vm;
+    bindVectorModule(vm);
+    vm.executeString("main", "import \"vector\" for Vec3\nclass Counter {\n  construct new(n) { _n = n }\n  add(x) { _n = _n + x }\n}\nvar a = Counter.new(1)\nvar b = Counter.new(10)");
+
+    // one call handle for any number of foreign receivers
+    std::vector<Vec3>  vectors{Vec3{3.f, 4.f, 0.f}, Vec3{0.f, 0.f, 2.f}};
+    std::vector<Vec3*> receivers{&vectors[0], &vectors[1]};
+    wrenpp::CallSignature norm = vm.signature("norm()");
+    assert(norm(&vectors[0]).as<double>() == 5.0);
+    assert(norm.forEach(receivers.begin(), receivers.end()) == 2u);
+
+    // and for Wren objects held by handles
+    WrenVM* ptr = vm.ptr();
+    std::vector<WrenHandle*> counters;
+    for (const char* name : {"a", "b"})
+    {
+        wrenEnsureSlots(ptr, 1);
+        wrenGetVariable(ptr, "main", name, 0);
+        counters.push_back(wrenGetSlotHandle(ptr, 0));
+    }
+    wrenpp::CallSignature add = vm.signature("add(_)");
+    assert(add.forEach(counters.begin(), counters.end(), 5) == 2u);
+    assert(add(counters[0], 1).as<double>() == 7.0);
+    assert(add(counters[1], 1).as<double>() == 16.0);
+    for (WrenHandle* counter : counters)
+    {
+        wrenReleaseHandle(ptr, counter);
+    }
+}
+
+void testJson()
+{
+    wrenpp::VM vm;
+    vm.beginModule("json")
+        .bindJson("Json")
+        .endClass()
+        .bindJsonDocument("JsonDocument")
+        .endClass()
+        .bindJsonWriter("JsonWriter")
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+
+    assert(vm.executeString("main",
+        "import \"json\" for Json, JsonDocument, JsonWriter\n"
+        "var list = Json.parse(\"[1, 2.5, \\\"a\\\\u00e9\\\", [true, null]]\")\n"
+        "if (list.count != 4 || list[1] != 2.5 || list[2] != \"a\\u00e9\" || list[3][1] != null) Fiber.abort(\"parse\")\n"
+        "if (Json.stringify(list) != \"[1,2.5,\\\"a\\u00e9\\\",[true,null]]\") Fiber.abort(\"stringify\")\n"
+        "var doc = JsonDocument.parse(\"{\\\"users\\\": [{\\\"name\\\": \\\"ann\\\"}, {\\\"name\\\": \\\"bob\\\"}]}\")\n"
+        "if (doc[\"users.1.name\"] != \"bob\" || doc[\"users.2\"] != null || doc.count(\"users\") != 2) Fiber.abort(\"paths\")\n"
+        "if (doc[\"users.18446744073709551617\"] != null) Fiber.abort(\"long indices\")\n"
+        "var users = doc[\"users\"]\n"
+        "if (users[\"0.name\"] != \"ann\" || !doc.has(\"users.0\")) Fiber.abort(\"sub-documents\")\n"
+        "var writer = JsonWriter.new()\n"
+        "writer.beginObject()\n"
+        "writer.key(\"users\")\n"
+        "writer.value(users)\n"
+        "writer.key(\"ids\")\n"
+        "writer.value([1, 2])\n"
+        "writer.endObject()\n"
+        "if (writer.toString != \"{\\\"users\\\":\" + users.toString + \",\\\"ids\\\":[1,2]}\") Fiber.abort(\"writer\")\n"
+        "if (Fiber.new { Json.parse(\"[1,]\") }.try() == null) Fiber.abort(\"invalid JSON\")\n"
+        "var numbers = Json.parse(\"[-2.5e-3, 1E2, 1e400]\")\n"
+        "if (numbers[0] != -0.0025 || numbers[1] != 100 || numbers[2] != Num.infinity) Fiber.abort(\"numbers\")"
+    ) == wrenpp::Result::Success);
+
+    // documents work from C++ too, and containers share the text
+    wrenpp::JsonDocument document("{\"a\": {\"b\": [10, 20]}}");
+    assert(document.at("a.b").text() == "[10, 20]");
+    assert(document.count("a.b") == 2u);
+    assert(!document.has("a.c"));
+
+    wrenpp::JsonWriter writer;
+    writer.beginArray();
+    writer.number(0.1);
+    writer.number(0.1 + 0.2);
+    writer.number(1e21);
+    writer.string("\"q\"");
+    writer.endArray();
+    assert(writer.text() == "[0.1,0.30000000000000004,1e+21,\"\\\"q\\\"\"]");
+}
+
+void testStringBuilder()
+{
+    wrenpp::VM vm;
+    vm.beginModule("text")
+        .bindByteBuffer("ByteBuffer")
+        .endClass()
+        .bindStringBuilder("StringBuilder")
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+
+    assert(vm.executeString("main",
+        "import \"text\" for ByteBuffer, StringBuilder\n"
+        "var report = StringBuilder.new()\n"
+        "for (i in 1..3) report.add(\"row \").add(i).add(\": \").padLeft(i / 4, 6).addLine(\"\")\n"
+        "report.add(true).add(null).addFixed(2 / 3, 2)\n"
+        "if (report.toString != \"row 1:   0.25\\nrow 2:    0.5\\nrow 3:   0.75\\ntruenull0.67\") Fiber.abort(report.toString)\n"
+        "var bytes = ByteBuffer.new()\n"
+        "bytes.addBytes(\"ab\")\n"
+        "bytes.addBytes(report)\n"
+        "if (bytes.count != 2 + report.count || bytes[1] != 98) Fiber.abort(\"bytes\")\n"
+        "if (StringBuilder.new().add(bytes).padRight(\"|\", 3).toString != bytes.toString + \"|  \") Fiber.abort(\"padding\")\n"
+        "if (Fiber.new { report.add([]) }.try() == null) Fiber.abort(\"lists can't be added\")\n"
+        "if (Fiber.new { report.padLeft(\"x\", 0 / 0) }.try() == null) Fiber.abort(\"NaN widths\")\n"
+        "if (Fiber.new { report.padLeft(\"x\", 1e300) }.try() == null) Fiber.abort(\"huge widths\")\n"
+        "if (Fiber.new { report.addFixed(1, 0 / 0) }.try() == null) Fiber.abort(\"NaN digits\")"
+    ) == wrenpp::Result::Success);
+
+    wrenpp::StringBuilder builder;
+    builder.add("pi ").addFixed(3.14159, 3);
+    const std::size_t start = builder.count();
+    builder.add(1e21).pad(start, 8, true);
+    assert(builder.text() == "pi 3.142   1e+21");
 }
 
 int main()
@@ -235,5 +1097,101 @@ int main()
 
     testStrings();
 
+    std::printf("\nTesting numeric buffers...\n\n");
+
+    testNumericBuffers();
+
+    std::printf("\nTesting memory-mapped files...\n\n");
+
+    testMappedFiles();
+
+    std::printf("\nTesting published objects...\n\n");
+
+    testPublishedObjects();
+
+    std::printf("\nTesting channels...\n\n");
+
+    testChannels();
+
+    std::printf("\nTesting channels shared between threads...\n\n");
+
+    testChannelThreads();
+
+    std::printf("\nTesting posting to a VM from another thread...\n\n");
+
+    testInbox();
+
+    std::printf("\nTesting the VM pool...\n\n");
+
+    testVMPool();
+
+    std::printf("\nTesting VM pool setup failures...\n\n");
+
+    testVMPoolSetupFailure();
+
+    std::printf("\nTesting shared binding sets...\n\n");
+
+    testBindingSet();
+
+    std::printf("\nTesting signature hashing...\n\n");
+
+    testSignatureHashing();
+
+    std::printf("\nTesting deferred module binding...\n\n");
+
+    testDeferredModules();
+
+    std::printf("\nTesting the profiler...\n\n");
+
+    testProfiling();
+
+    std::printf("\nTesting the tracer...\n\n");
+
+    testTracing();
+
+    std::printf("\nTesting the foreign object census...\n\n");
+
+    testCensus();
+
+    std::printf("\nTesting recording and replaying calls...\n\n");
+
+    testRecordReplay();
+
+    std::printf("\nTesting the handle cache...\n\n");
+
+    testHandleCache();
+
+    std::printf("\nTesting call signatures...\n\n");
+
+    testCallSignature();
+
+    std::printf("\nTesting Wren functions called from C++...\n\n");
+
+    testFunctions();
+
+    std::printf("\nTesting bound functors...\n\n");
+
+    testFunctors();
+
+    std::printf("\nTesting dirty tracking...\n\n");
+
+    testDirtyTracking();
+
+    std::printf("\nTesting generational handles...\n\n");
+
+    testHandles();
+
+    std::printf("\nTesting class inheritance...\n\n");
+
+    testInheritance();
+
+    std::printf("\nTesting the JSON module...\n\n");
+
+    testJson();
+
+    std::printf("\nTesting string builders...\n\n");
+
+    testStringBuilder();
+
     return 0;
 }
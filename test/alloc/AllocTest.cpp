@@ -0,0 +1,125 @@
+// Counts the allocations made by hot paths, and fails if the counts change. Runs after the
+// alloc project builds, so that a change which adds an allocation breaks the build.
+
+#include "Wren++.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+std::size_t reallocations = 0u;  // by Wren, through VM::reallocateFn
+std::size_t news          = 0u;  // by C++, through operator new
+
+struct Vec3
+{
+    float x, y, z;
+
+    float norm() const
+    {
+        return std::sqrt(x * x + y * y + z * z);
+    }
+
+    Vec3 plus(const Vec3& rhs) const
+    {
+        return Vec3{x + rhs.x, y + rhs.y, z + rhs.z};
+    }
+};
+
+int failures = 0;
+
+// Runs the operation until Wren's fiber and the bindings' caches have settled, then checks how
+// often it allocates per run.
+template <typename Operation>
+void expectAllocations(const char* name, std::size_t expectedReallocations, std::size_t expectedNews,
+                       Operation operation)
+{
+    const std::size_t runs = 100u;
+    for (std::size_t i = 0u; i < 10u; ++i)
+    {
+        operation();
+    }
+
+    reallocations = 0u;
+    news          = 0u;
+    for (std::size_t i = 0u; i < runs; ++i)
+    {
+        operation();
+    }
+    const std::size_t r = reallocations;
+    const std::size_t n = news;
+
+    if (r != expectedReallocations * runs || n != expectedNews * runs)
+    {
+        std::printf("FAILED %s: %.2f reallocations and %.2f news per run, expected %zu and %zu\n", name,
+                    static_cast<double>(r) / runs, static_cast<double>(n) / runs, expectedReallocations,
+                    expectedNews);
+        ++failures;
+    }
+    else
+    {
+        std::printf("ok %s\n", name);
+    }
+}
+}
+
+void* operator new(std::size_t size)
+{
+    ++news;
+    if (void* memory = std::malloc(size ? size : 1u))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+int main()
+{
+    wrenpp::VM::reallocateFn = [](void* memory, std::size_t size) -> void* {
+        if (size != 0u)
+        {
+            ++reallocations;
+        }
+        return std::realloc(memory, size);
+    };
+
+    wrenpp::VM vm;
+    vm.beginModule("vector")
+        .bindClass<Vec3, float, float, float>("Vec3")
+            .bindGetter<decltype(Vec3::x), &Vec3::x>("x")
+            .bindMethod<decltype(&Vec3::norm), &Vec3::norm>(false, "norm()")
+            .bindMethod<decltype(&Vec3::plus), &Vec3::plus>(false, "plus(_)")
+        .endClass()
+        .generateDeclarations()
+    .endModule();
+    vm.executeString("main",
+        "import \"vector\" for Vec3\n"
+        "var a = Vec3.new(1, 2, 3)\n"
+        "var b = Vec3.new(4, 5, 6)\n"
+        "var add = Fn.new { |x, y| x + y }\n"
+        "var getX = Fn.new { a.x }\n"
+        "var plus = Fn.new { a.plus(b) }\n");
+
+    wrenpp::Method add  = vm.method("main", "add", "call(_,_)");
+    wrenpp::Method getX = vm.method("main", "getX", "call()");
+    wrenpp::Method plus = vm.method("main", "plus", "call()");
+
+    expectAllocations("numeric Method call", 0u, 0u, [&add]() { add(1.0, 2.0); });
+    expectAllocations("scalar getter", 0u, 0u, [&getX]() { getX(); });
+    // the returned Vec3 lives in the Wren heap
+    expectAllocations("Vec3 returned by value", 1u, 0u, [&plus]() { plus(); });
+
+    return failures == 0 ? 0 : 1;
+}
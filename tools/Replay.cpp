@@ -0,0 +1,52 @@
+// Replays a recording made with wrenpp::VM::startRecording in a fresh VM, and reports how fast
+// the recorded calls ran. Scripts are loaded from the working directory, as by the default
+// loadModuleFn. Recordings which pass instances of bound classes need a driver which binds
+// them first; this one binds nothing.
+//
+// usage: replay <recording> [repetitions]
+
+#include "Wren++.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::fprintf(stderr, "usage: %s <recording> [repetitions]\n", argv[0]);
+        return 1;
+    }
+    const int repetitions = argc > 2 ? std::atoi(argv[2]) : 1;
+
+    for (int i = 0; i < repetitions; ++i)
+    {
+        std::ifstream recording(argv[1], std::ios::binary);
+        if (!recording)
+        {
+            std::fprintf(stderr, "can't open %s\n", argv[1]);
+            return 1;
+        }
+
+        wrenpp::VM           vm;
+        wrenpp::ReplayReport report;
+        try
+        {
+            report = wrenpp::replay(vm, recording);
+        }
+        catch (const std::exception& e)
+        {
+            std::fprintf(stderr, "%s: %s\n", argv[1], e.what());
+            return 1;
+        }
+
+        std::printf("%zu calls (%zu skipped, %zu failed) in %.3f ms, %.0f calls/s\n", report.calls, report.skipped,
+                    report.failed, report.seconds * 1e3,
+                    report.seconds > 0.0 ? static_cast<double>(report.calls) / report.seconds : 0.0);
+        std::printf("latency p50 %.2f us, p90 %.2f us, p99 %.2f us\n", report.p50, report.p90, report.p99);
+    }
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Reports the bytes of code generated for bound functions in a binary or object file: the
+# per-function thunks, and the marshalling functions which they share.
+#
+#   tools/binding-size.sh bin/test [-v]
+#
+# -v lists every thunk and shared function along with its size.
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <binary or object file> [-v]" >&2
+    exit 1
+fi
+
+nm -C -S --size-sort --radix=d "$1" | awk -v verbose="$2" '
+    # the fourth field onwards is the demangled name
+    {
+        name = $4
+        for (i = 5; i <= NF; ++i)
+        {
+            name = name " " $i
+        }
+        size = $2 + 0
+    }
+    name ~ /wrenpp::detail::(ForeignMethodWrapper|TrackedMethodWrapper)<.*>::(call\(WrenVM\*\)|invoke\(void\*)/ ||
+    name ~ /wrenpp::detail::(propertyGetter|propertySetter|functorThunk)</ {
+        thunks += 1
+        thunkBytes += size
+        if (verbose == "-v")
+        {
+            printf "%8d  thunk   %s\n", size, name
+        }
+        next
+    }
+    name ~ /wrenpp::detail::(callFunction|callMethod|methodReceiver|getField|setField|invokeFunctor)</ {
+        shared += 1
+        sharedBytes += size
+        if (verbose == "-v")
+        {
+            printf "%8d  shared  %s\n", size, name
+        }
+    }
+    END {
+        printf "%d bound function thunks: %d bytes\n", thunks, thunkBytes
+        printf "%d shared marshalling functions: %d bytes\n", shared, sharedBytes
+        if (thunks > 0)
+        {
+            printf "%.1f bytes of binding code per thunk\n", (thunkBytes + sharedBytes) / thunks
+        }
+    }'